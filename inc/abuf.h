@@ -1,15 +1,20 @@
 #ifndef _ABUF_H
 #define _ABUF_H
 
+/* Output buffer that keeps its memory when emptied, so one can be reused for
+   every frame without allocating once it has grown to the frame size. */
 struct abuf {
     char* b;
     int len;
+    int cap;
 };
 
 #define ABUF_INIT \
-    { NULL, 0 }
+    { NULL, 0, 0 }
 
 void ab_append(struct abuf* ab, const char* s, int len);
+void ab_putc(struct abuf* ab, char c);
+void ab_sgr(struct abuf* ab, int code);
 void ab_free(struct abuf* ab);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,30 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+// Blocks come in power of two size classes from 16 bytes to 64 KiB
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 13
+#define ARENA_SLAB_SIZE (1 << 20)
+
+struct arena_slab;
+struct arena_large;
+
+/* Owns variable sized blocks of text. Small blocks are carved out of large
+   slabs and recycled through per class free lists, bigger ones get their own
+   allocation. Everything is released at once by arena_free. */
+struct arena {
+    struct arena_slab* slabs;  // newest first, blocks are bumped off the head
+    struct arena_large* large;
+    void* free[ARENA_CLASSES];
+};
+
+#define ARENA_INIT \
+    { NULL, NULL, { NULL } }
+
+void* arena_alloc(struct arena* a, size_t len, size_t* cap);
+void arena_release(struct arena* a, void* p, size_t cap);
+void arena_free(struct arena* a);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _EROW_H
+#define _EROW_H
+
+// A run of rendered characters sharing one editor_highlight class
+struct hl_span {
+    int start, len;
+    unsigned char hl;
+};
+
+/* render and rsize live in the render cache, along with the row's highlight
+   spans, and are only valid after the row has been fetched through
+   editor_row_rendered. For long rows render only covers the part in view. */
+typedef struct erow {
+    int size, rsize;
+    char *chars, *render;
+    int gap, gaplen;  // chars has gaplen unused bytes starting at gap
+    int stale;        // render and highlighting are out of date with chars
+    unsigned int id;  // tags the row's render cache slot, 0 until rendered
+    int rslot;        // render cache slot, -1 if never rendered
+    int shared;       // chars points into the file buffer, not the text arena
+    int hl_open;      // row ends inside a block comment, -1 if not lexed yet
+} erow;
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _GRAM_H
+#define _GRAM_H
+
+/* Trigram filters for search. A filter has one bit for each hashed run of
+   three bytes added to it, with ASCII letters folded to lower case, so a text
+   holding a query sets every bit the query's own trigrams do. A query that
+   finds one of them unset cannot be in the text, while one finding them all
+   set still has to be searched for, since trigrams share bits.
+
+   A filter is sized for the text it is made for, about a bit for each byte
+   rounded down to a power of two. Once more than half its bits are set it
+   rules too little out to be worth its memory, see gram_full. */
+
+#define GRAM_MIN_SHIFT 6   // smallest filter, 64 bits
+#define GRAM_MAX_SHIFT 20  // biggest filter, 128 KB
+
+struct gram {
+    int shift;  // the filter has 1 << shift bits
+    int ones;   // of them set
+    unsigned char bits[];
+};
+
+struct gram* gram_new(int len);
+struct gram* gram_copy(const struct gram* f);
+int gram_bytes(const struct gram* f);
+void gram_add(struct gram* f, const char* s, int len);
+int gram_full(const struct gram* f);
+int gram_may_hold(const struct gram* f, const char* q, int len);
+struct gram* gram_merge(struct gram* dst, const struct gram* src);
+
+#endif
@@ -1,6 +1,18 @@
 #define HAYAI_VERSION "1.1.0"
 #define HAYAI_TAB_STOP 4
 #define HAYAI_QUIT_TIMES 3
+#define HAYAI_RENDER_CACHE 256
+#define HAYAI_PREFETCH_ROWS 16
+#define HAYAI_ROW_MARK 4096
+#define HAYAI_SYNTAX_CHUNK (1 << 18)
+#define HAYAI_FIND_ROWS 8192
+#define HAYAI_FIND_CHUNK (1 << 20)
+#define HAYAI_GRAM_MIN_SIZE (1 << 24)
+#define HAYAI_UNDO_BUDGET (1 << 23)
+#define HAYAI_INPUT_BUFFER 4096
+#define HAYAI_FRAME_MS 16
+#define HAYAI_ESCAPE_MS 100
+#define HAYAI_PASTE_MS 1000
 
 // FLAGS FOR SYNTAX HIGHLIGHTING
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
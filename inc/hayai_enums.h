@@ -9,6 +9,8 @@ enum editor_key {
     DEL_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
 };
 
 enum editor_highlight {
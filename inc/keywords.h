@@ -0,0 +1,22 @@
+#ifndef _KEYWORDS_H
+#define _KEYWORDS_H
+
+struct kw_entry {
+    const char* word;
+    int len;
+    unsigned char hl;  // editor_highlight class of the keyword
+};
+
+/* Keyword list of a syntax compiled into a perfect hash: every keyword has a
+   slot of its own, so a lookup hashes the token once and compares once. */
+struct kwtable {
+    struct kw_entry* slots;
+    unsigned int mask;  // slot count - 1
+    unsigned int seed;
+    int minlen, maxlen;
+};
+
+struct kwtable* kw_compile(char** keywords);
+int kw_lookup(const struct kwtable* t, const char* s, int len);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+
+/* A fixed set of worker threads taking tasks off a shared queue in the order
+   they were submitted. */
+struct pool;
+
+struct pool* pool_new(int nthreads);
+void pool_submit(struct pool* p, void (*fn)(void*), void* arg);
+int pool_idle(struct pool* p);   // nothing queued or running
+void pool_wait(struct pool* p);  // blocks until the pool is idle
+void pool_notify(struct pool* p, int fd);  // write a byte to fd on going idle
+
+/* Counts down the tasks of one job, so it can be waited for apart from
+   whatever else the pool is running. Each of its tasks calls pool_group_done
+   as its last step. */
+struct pool_group {
+    pthread_mutex_t lock;
+    pthread_cond_t done;  // signalled when the last task is done
+    int left;             // tasks not done yet
+    int notify;           // gets a byte when the last task is done, -1 if unset
+};
+
+void pool_group_init(struct pool_group* g, int tasks, int notify);
+void pool_group_done(struct pool_group* g);
+int pool_group_idle(struct pool_group* g);
+void pool_group_wait(struct pool_group* g);
+void pool_group_free(struct pool_group* g);
+
+#endif
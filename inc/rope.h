@@ -0,0 +1,39 @@
+#ifndef _ROPE_H
+#define _ROPE_H
+
+#include "./erow.h"
+
+struct gram;
+
+// Rows stored per leaf, children stored per inner node
+#define ROPE_LEAF_ROWS 64
+#define ROPE_FANOUT 32
+
+/* Counted B+tree of rows. Leaves hold the rows themselves and are chained
+   together so walking consecutive rows does not descend from the root. */
+struct rope_node {
+    int leaf;
+    int count;  // rows in a leaf, children in an inner node
+    int total;  // rows in this subtree
+    struct rope_node* child[ROPE_FANOUT + 1];  // room for one before a split
+    struct rope_node *prev, *next;             // neighbouring leaves
+    struct gram* grams;  // trigram filter of a leaf's rows or NULL, gram.h
+    erow rows[ROPE_LEAF_ROWS];
+};
+
+struct rope {
+    struct rope_node* root;
+    struct rope_node* cache;  // leaf of the last lookup
+    int cache_start;          // index of the first row in cache
+};
+
+#define ROPE_INIT \
+    { NULL, NULL, 0 }
+
+struct rope_node* rope_leaf(struct rope* r, int at, int* start);
+erow* rope_get(struct rope* r, int at);
+erow* rope_insert(struct rope* r, int at);
+void rope_delete(struct rope* r, int at);
+void rope_free(struct rope* r);
+
+#endif
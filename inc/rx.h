@@ -0,0 +1,32 @@
+#ifndef _RX_H
+#define _RX_H
+
+/* Regular expressions for search. A pattern is compiled to an NFA, which is
+   matched through a DFA built from it as the text needs its states, so a
+   match is found in time linear in the text however the pattern is written.
+   Patterns can use literals, ., [ ] classes, \d \w \s and their negations,
+   ^ $, * + ? and | with ( ) groups. */
+
+// DFA states kept before the DFA is cleared and built up again
+#define RX_DFA_STATES 512
+
+struct rx;
+struct rx_dfa;
+
+// Returns NULL and sets *error if the pattern is not valid
+struct rx* rx_compile(const char* pattern, int len, int fold,
+                      const char** error);
+void rx_free(struct rx* re);
+
+/* States built while matching re. A compiled rx is only read, so threads can
+   share one as long as each matches through its own rx_dfa. */
+struct rx_dfa* rx_dfa_new(const struct rx* re);
+void rx_dfa_free(struct rx_dfa* d);
+
+/* Calls found with the start and length of each leftmost longest match in
+   the len bytes of s, in order. Matches never overlap and are never empty, ^
+   and $ match at the ends of s. */
+void rx_find_all(struct rx_dfa* d, const char* s, int len,
+                 void (*found)(void*, int, int), void* arg);
+
+#endif
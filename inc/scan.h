@@ -0,0 +1,20 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/* Byte scanning kernels for the highlighter and search. Each one looks at 32
+   bytes at a time with AVX2, 16 with SSE2, or one at a time when neither is
+   enabled, and returns a length in [0, len]. */
+
+int scan_word(const char* s, int len);  // run of [A-Za-z0-9_]
+int scan_blank(const char* s, int len);  // run of spaces
+int scan_until2(const char* s, int len, char a, char b);  // bytes before a or b
+int scan_count(const char* s, int len, char c);  // bytes equal to c
+
+/* Bytes before the first match of the nlen byte needle n, len if none. With
+   fold set ASCII letters match either case. Places are ruled out on their
+   first and last bytes, long needles skip along instead without vectors.
+   Long needles that keep passing those tests go over to Two-Way, so no text
+   takes more than linear time. */
+int scan_find(const char* s, int len, const char* n, int nlen, int fold);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _UNDO_H
+#define _UNDO_H
+
+#include <stddef.h>
+
+#include "./arena.h"
+
+// Records are packed into blocks this big, larger ones get a block each
+#define UNDO_BLOCK 4096
+
+enum undo_kind {
+    UNDO_INSERT,   // text put into row at cx
+    UNDO_DELETE,   // text taken out of row at cx
+    UNDO_SPLIT,    // row broken in two at cx
+    UNDO_JOIN,     // the row below appended to row, which was cx long
+    UNDO_ADD_ROW,  // row added, holding text
+};
+
+struct undo_rec {
+    struct undo_rec *prev, *next;  // neighbours in the log
+    int kind;
+    int row, cx;
+    int len;   // of text
+    int step;  // first record of a step, the edits undone together
+    char text[];
+};
+
+struct undo_block;
+
+/* Edits in the order they were made, packed one after another into blocks
+   from an arena. Undoing walks back over them and redoing forward again, and
+   a new edit drops the ones undone. Once the blocks take more than budget
+   bytes the oldest are released, along with the steps they held. */
+struct undo_log {
+    struct arena mem;
+    struct undo_block *first, *last;
+    struct undo_rec* oldest;  // first record that can be undone
+    struct undo_rec* newest;
+    struct undo_rec* done;  // newest record not undone, NULL if none is
+    struct undo_rec* keys;  // newest record if keys can be added to it
+    size_t size, budget;
+    int step;  // the next record starts a step
+    int lost;  // the step being recorded lost its start, the rest goes too
+};
+
+#define UNDO_INIT(budget) \
+    { ARENA_INIT, NULL, NULL, NULL, NULL, NULL, NULL, 0, budget, 0, 0 }
+
+void undo_step(struct undo_log* u);
+void undo_add(struct undo_log* u, int kind, int row, int cx, const char* text,
+              int len);
+void undo_keys(struct undo_log* u);
+int undo_join(struct undo_log* u, int kind, int row, int cx, const char* text,
+              int len);
+struct undo_rec* undo_back(struct undo_log* u);
+struct undo_rec* undo_forward(struct undo_log* u, int within);
+void undo_free(struct undo_log* u);
+
+#endif
@@ -3,15 +3,48 @@
 #include <stdlib.h>
 #include <string.h>
 
-void ab_append(struct abuf* ab, const char* s, int len) {
-    char* new = realloc(ab->b, ab->len + len);
+// Makes room for len more bytes, growing geometrically. Returns 0 on failure.
+static int ab_reserve(struct abuf* ab, int len) {
+    if (ab->len + len <= ab->cap) return 1;
+
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char* new = realloc(ab->b, cap);
 
     if (new == NULL) {
-        return;
+        return 0;
     }
-    memcpy(&new[ab->len], s, len);
     ab->b = new;
+    ab->cap = cap;
+    return 1;
+}
+
+void ab_append(struct abuf* ab, const char* s, int len) {
+    if (!ab_reserve(ab, len)) return;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
-void ab_free(struct abuf* ab) { free(ab->b); }
\ No newline at end of file
+void ab_putc(struct abuf* ab, char c) {
+    if (ab->len == ab->cap && !ab_reserve(ab, 1)) return;
+    ab->b[ab->len++] = c;
+}
+
+// Appends the SGR sequence ESC [ code m, code being at most 3 digits
+void ab_sgr(struct abuf* ab, int code) {
+    if (!ab_reserve(ab, 6)) return;
+    char* p = &ab->b[ab->len];
+    *p++ = '\x1b';
+    *p++ = '[';
+    if (code >= 100) *p++ = '0' + code / 100;
+    if (code >= 10) *p++ = '0' + code / 10 % 10;
+    *p++ = '0' + code % 10;
+    *p++ = 'm';
+    ab->len = p - ab->b;
+}
+
+void ab_free(struct abuf* ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
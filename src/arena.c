@@ -0,0 +1,86 @@
+#include "./arena.h"
+
+#include <stdlib.h>
+
+struct arena_slab {
+    struct arena_slab* next;
+    size_t used;
+    char data[ARENA_SLAB_SIZE];
+};
+
+// Header in front of blocks too big for a size class
+struct arena_large {
+    struct arena_large *prev, *next;
+};
+
+static int arena_class(size_t len) {
+    int c = 0;
+    while (((size_t)1 << (c + ARENA_MIN_SHIFT)) < len) c++;
+    return c;
+}
+
+/* Returns a block of at least len bytes and stores its real size in *cap.
+   Sizes are rounded up to a power of two, so a buffer that regrows through
+   here at least doubles every time. */
+void* arena_alloc(struct arena* a, size_t len, size_t* cap) {
+    int c = arena_class(len);
+    size_t size = (size_t)1 << (c + ARENA_MIN_SHIFT);
+    *cap = size;
+
+    if (c >= ARENA_CLASSES) {
+        struct arena_large* l = malloc(sizeof(struct arena_large) + size);
+        if (l == NULL) return NULL;
+        l->prev = NULL;
+        l->next = a->large;
+        if (a->large) a->large->prev = l;
+        a->large = l;
+        return l + 1;
+    }
+
+    if (a->free[c]) {
+        void* p = a->free[c];
+        a->free[c] = *(void**)p;
+        return p;
+    }
+
+    if (a->slabs == NULL || a->slabs->used + size > ARENA_SLAB_SIZE) {
+        struct arena_slab* s = malloc(sizeof(struct arena_slab));
+        if (s == NULL) return NULL;
+        s->next = a->slabs;
+        s->used = 0;
+        a->slabs = s;
+    }
+    void* p = &a->slabs->data[a->slabs->used];
+    a->slabs->used += size;
+    return p;
+}
+
+// Hands a block back, cap is the size arena_alloc reported for it
+void arena_release(struct arena* a, void* p, size_t cap) {
+    int c = arena_class(cap);
+    if (c >= ARENA_CLASSES) {
+        struct arena_large* l = (struct arena_large*)p - 1;
+        if (l->prev) l->prev->next = l->next;
+        if (l->next) l->next->prev = l->prev;
+        if (a->large == l) a->large = l->next;
+        free(l);
+        return;
+    }
+
+    *(void**)p = a->free[c];
+    a->free[c] = p;
+}
+
+void arena_free(struct arena* a) {
+    while (a->slabs) {
+        struct arena_slab* s = a->slabs;
+        a->slabs = s->next;
+        free(s);
+    }
+    while (a->large) {
+        struct arena_large* l = a->large;
+        a->large = l->next;
+        free(l);
+    }
+    for (int c = 0; c < ARENA_CLASSES; c++) a->free[c] = NULL;
+}
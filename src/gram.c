@@ -0,0 +1,100 @@
+#include "./gram.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bits of a filter are picked by the top bits of the hash, so halving a
+// filter's size only has to fold each pair of neighbouring bits into one
+static unsigned int gram_hash(const unsigned char* s) {
+    unsigned int a = s[0], b = s[1], c = s[2];
+    // Upper case letters become lower case
+    a |= (a - 'A' < 26u) << 5;
+    b |= (b - 'A' < 26u) << 5;
+    c |= (c - 'A' < 26u) << 5;
+    return (a << 16 | b << 8 | c) * 2654435761u;
+}
+
+static int gram_ones(const unsigned char* p, int n) {
+    int ones = 0;
+    for (int i = 0; i < n; i++) {
+        for (unsigned int b = p[i]; b; b &= b - 1) ones++;
+    }
+    return ones;
+}
+
+// Returns an empty filter sized for len bytes of text, NULL if out of memory
+struct gram* gram_new(int len) {
+    int shift = GRAM_MIN_SHIFT;
+    while (shift < GRAM_MAX_SHIFT && (1 << (shift + 1)) <= len) shift++;
+    struct gram* f = calloc(1, sizeof(struct gram) + (1 << shift) / 8);
+    if (f) f->shift = shift;
+    return f;
+}
+
+struct gram* gram_copy(const struct gram* f) {
+    struct gram* g = malloc(gram_bytes(f));
+    if (g) memcpy(g, f, gram_bytes(f));
+    return g;
+}
+
+// Memory the filter takes
+int gram_bytes(const struct gram* f) {
+    return sizeof(struct gram) + (1 << f->shift) / 8;
+}
+
+// Sets the bits of every trigram of the len bytes of s
+void gram_add(struct gram* f, const char* s, int len) {
+    const unsigned char* p = (const unsigned char*)s;
+    for (int i = 0; i + 3 <= len; i++) {
+        unsigned int h = gram_hash(&p[i]) >> (32 - f->shift);
+        unsigned char bit = 1 << (h & 7);
+        if (!(f->bits[h >> 3] & bit)) {
+            f->bits[h >> 3] |= bit;
+            f->ones++;
+        }
+    }
+}
+
+int gram_full(const struct gram* f) {
+    return f->ones > 1 << (f->shift - 1);
+}
+
+// Returns 0 only if the len bytes of q are not in any text added to f
+int gram_may_hold(const struct gram* f, const char* q, int len) {
+    const unsigned char* p = (const unsigned char*)q;
+    for (int i = 0; i + 3 <= len; i++) {
+        unsigned int h = gram_hash(&p[i]) >> (32 - f->shift);
+        if (!(f->bits[h >> 3] & (1 << (h & 7)))) return 0;
+    }
+    return 1;
+}
+
+/* Adds the trigrams of src to dst, folding dst down to the size of src first
+   if it is bigger. Returns dst, which may have moved when it shrank. */
+struct gram* gram_merge(struct gram* dst, const struct gram* src) {
+    while (dst->shift > src->shift) {
+        int n = (1 << dst->shift) / 16;  // bytes once halved
+        for (int i = 0; i < n; i++) {
+            unsigned int a = dst->bits[2 * i], b = dst->bits[2 * i + 1];
+            unsigned int folded = 0;
+            for (int k = 0; k < 4; k++) {
+                folded |= ((a >> 2 * k | a >> (2 * k + 1)) & 1) << k;
+                folded |= ((b >> 2 * k | b >> (2 * k + 1)) & 1) << (k + 4);
+            }
+            dst->bits[i] = folded;
+        }
+        dst->shift--;
+    }
+
+    int n = (1 << dst->shift) / 8;
+    int step = src->shift - dst->shift;  // each bit of dst covers 1 << step
+    for (int i = 0; i < (1 << src->shift); i++) {
+        if (src->bits[i >> 3] & (1 << (i & 7))) {
+            int j = i >> step;
+            dst->bits[j >> 3] |= 1 << (j & 7);
+        }
+    }
+    dst->ones = gram_ones(dst->bits, n);
+    struct gram* moved = realloc(dst, gram_bytes(dst));
+    return moved ? moved : dst;
+}
@@ -6,19 +6,33 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "./abuf.h"
+#include "./arena.h"
+#include "./erow.h"
+#include "./gram.h"
 #include "./hayai_constants.h"
 #include "./hayai_enums.h"
+#include "./keywords.h"
+#include "./pool.h"
+#include "./rope.h"
+#include "./rx.h"
+#include "./scan.h"
+#include "./undo.h"
 #include "hayai_colours.h"
 
 /* STRUCTS */
@@ -27,14 +41,140 @@ struct editor_syntax {
     char** filematch;
     char** keywords;
     char* single_line_comment_start;
+    char* multi_line_comment_start;
+    char* multi_line_comment_end;
     int flags;
+    struct kwtable* kw;  // keywords compiled on first selection
 };
 
-typedef struct erow {
-    int size, rsize;
-    char *chars, *render;
-    unsigned char* hl;
-} erow;
+// Where the lexer is within a row
+struct hl_state {
+    unsigned char comment;  // 1 in a block comment, 2 in a line comment
+    char string;            // quote of the string it is in, 0 if none
+    unsigned char sep;      // last byte was a separator
+    unsigned char hl;       // class of the last byte
+};
+
+// Point of a long row the lexer can start again from
+struct row_mark {
+    int cx, rx;  // chars index and render column
+    int tabs;    // tabs between here and the next mark
+    struct hl_state st;
+};
+
+/* Rendered text and highlighting of one row, reused across rows. Long rows
+   only have the part around the view rendered, found from their marks. */
+struct render_slot {
+    unsigned int owner;  // id of the row rendered here, 0 if free
+    int ref;             // used since the clock hand last passed
+    char* render;        // unused while the row's render shares its chars
+    int rendercap;
+    struct hl_span* hl;  // covers all of render, in order, from column 0
+    int nhl, hlcap;
+    int wcx, wend;    // chars [wcx, wend) are in render
+    int wrx, wrlen;   // render columns they take up, from wrx
+    struct row_mark* marks;  // about HAYAI_ROW_MARK bytes apart, first at 0
+    int nmarks, markcap;     // no marks yet if 0
+    int dirty, dirty_end;    // chars changed since the marks, -1 if none
+};
+
+// Rows of the file buffer lexed by one background task
+struct hl_chunk {
+    struct hl_job* job;
+    const char *start, *end;  // whole rows of E.filebuf
+    struct editor_syntax* syntax;
+    int nrows;
+    unsigned char* ends;  // bit s set if the row ends in a block comment when
+                          // the chunk starts in state s
+};
+
+// End states of the rows from first onwards, worked out on the worker pool
+struct hl_job {
+    struct hl_chunk* chunks;
+    int nchunks;
+    struct pool_group lexed;  // of the chunks' tasks
+    int first;
+    int open;   // hl_open of the row above first
+    int limit;  // rows from here on changed since the job started
+};
+
+// Leaves [from, to) of a gram_job, filtered by one task
+struct gram_chunk {
+    struct gram_job* job;
+    int from, to;
+};
+
+// Trigram filters of every leaf, built from the file buffer on the pool
+struct gram_job {
+    const char** starts;  // of each leaf's rows in E.filebuf, NULL if not there
+    const char** ends;
+    struct gram** grams;  // filter of each leaf, NULL if it has none
+    int nleaves;
+    struct gram_chunk* chunks;
+    int nchunks;
+    struct pool_group built;  // of the chunks' tasks
+};
+
+// Where the search query matched, by row and chars index, and how much
+struct find_match {
+    int row, cx, len;
+};
+
+struct find_set {
+    struct find_match* m;
+    int n, cap;
+    int known;  // holds every match in the file, not just those found so far
+};
+
+/* Matches of every prefix of the search query, so typing only narrows the
+   last set down and backspace goes back to an earlier one. */
+struct find_cache {
+    char* query;  // what the sets were found for
+    int len, cap;
+    struct find_set* sets;  // sets[i] matches the first i + 1 bytes
+    int shown;              // set of the query in the prompt, -1 if none
+    int current;            // index of the match moved to in it
+    int fold;               // letters match either case
+    int regex;              // the query is a pattern, see rx.h
+    int index;              // files get a search index, see editor_grams_switch
+    struct rx* re;          // the query compiled, NULL if it is not valid
+    const char* error;      // why it is not
+};
+
+// Rows searched for the query by one background task
+struct find_chunk {
+    struct find_job* job;
+    const char *start, *end;  // whole rows of E.filebuf, or NULL to use leaf
+    struct rope_node* leaf;   // leaf holding the first row
+    int index;                // of the first row in leaf
+    int first, nrows;         // rows [first, first + nrows) of the file
+    struct find_set found;    // rows counted from first
+    int started, done;  // under job->lock
+};
+
+/* Search of the whole file for one query, spread over the worker pool. Its
+   tasks can be queued behind other jobs', so a cancelled search is not waited
+   for: the chunks not started yet are skipped and the last task frees it. */
+struct find_job {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  // signalled as each chunk finishes
+    char* query;
+    int len, fold;
+    const struct rx* re;  // pattern to search for instead, owned by E.find
+    int level;            // E.find.sets[level] is being filled
+    struct find_chunk* chunks;
+    int nchunks;
+    int taken;      // chunks already added to the set, in order
+    int cancelled;  // under lock
+    int running;    // chunks being searched, reading rows, under lock
+    int tasks;      // tasks on the pool that have not returned, under lock
+};
+
+// One character on the screen and how it is drawn
+struct cell {
+    char c;
+    unsigned char hl;  // editor_highlight class, maybe with CELL_INVERSE
+};
 
 struct editor_config {
     int cx, cy;
@@ -43,11 +183,40 @@ struct editor_config {
     int screenrows, screencols;
     int numrows;
     int dirty;  // file modified but not saved flag
-    erow* row;
+    struct rope rows;
+    struct arena text;    // text of rows that no longer share filebuf
+    unsigned int rowids;  // last id handed out to a row
+    struct render_slot* rcache;
+    int rcache_len;
+    int rhand;  // next slot the clock hand looks at for eviction
+    char* lexbuf;  // chars copied out from around a row's gap
+    int lexcap;
+    char* filebuf;  // contents of the opened file, shared rows point into it
+    size_t filebuf_len;
+    int filebuf_mapped;  // filebuf is a mmap of the file, not a malloc
     char* filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editor_syntax* syntax;
+    struct find_cache find;
+    struct find_job* findjob;  // background search in progress, NULL if none
+    int hl_known;  // rows above this have an up to date hl_open
+    struct cell* frame;  // screen as last drawn, screencols cells per line
+    struct cell* next;   // frame being drawn
+    int frame_valid;     // 0 until frame matches the terminal
+    int frame_cy, frame_cx;  // where the cursor was last put
+    int frame_rowoff, frame_coloff;  // view offsets of the last frame
+    int draw_y, draw_x;      // where drawing the frame left the cursor
+    struct abuf out;         // frame output, reused for every frame
+    struct pool* pool;
+    struct hl_job* hljob;  // background lexing in progress, NULL if none
+    struct gram_job* gramjob;  // search index being built, NULL if none
+    int indexed;  // KB of trigram filters given to leaves, see editor_grams_bg_start
+    struct undo_log undo;  // edits that can be undone, see editor_undo_apply
+    char input[HAYAI_INPUT_BUFFER];  // read from the terminal, not yet handled
+    int inputlen, inputpos;
+    int wake[2];  // self-pipe for the event loop, see editor_wait
+    volatile sig_atomic_t resized;  // set by SIGWINCH
     struct termios orig_termios;
 };
 
@@ -68,13 +237,19 @@ struct editor_syntax HLDB[] = {{
     Reigai_HL_extensions,
     Reigai_HL_keywords,
     "//",
+    "/*",
+    "*/",
     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL,
 }};
 
 /* MACROS */
 // Converts ASCII character k into ASCII character equivalent to keypress CTRL+k
 #define CTRL_KEY(k) ((k)&0x1f)
 
+// Cell drawn with foreground and background swapped
+#define CELL_INVERSE 0x80
+
 // Number of items in HLDB
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
@@ -82,7 +257,15 @@ struct editor_syntax HLDB[] = {{
 
 void editor_set_status(const char* fmt, ...);
 void editor_refresh_screen();
-char* editor_prompt(char* prompt, void (*callback)(char*, int));
+char* editor_prompt(char* prompt, void (*callback)(char*, int), int empty);
+void editor_update_syntax_from(int at);
+void editor_syntax_bg_start();
+void editor_syntax_bg_finish(int wait);
+void editor_grams_bg_finish(int wait);
+void editor_grams_note(int at, int from, int to);
+void editor_syntax_bg_drop();
+void editor_find_bg_collect();
+void editor_resize();
 
 /* TERMINAL FUNCTIONS */
 
@@ -95,6 +278,7 @@ void die(const char* s) {
 }
 
 void disable_raw_mode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);  // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
         die("tcsetattr");
     };
@@ -111,36 +295,105 @@ void enable_raw_mode() {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= ~(CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 0;  // input is only read once poll says it is there
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+
+    // Pasted text comes wrapped in ESC [ 200~ and ESC [ 201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editor_read_key() {
-    int nread;
-    char c;
+// Milliseconds on a clock that only moves forward
+long editor_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("read");
+void editor_handle_winch(int sig) {
+    (void)sig;
+    int saved = errno;
+    E.resized = 1;
+    write(E.wake[1], "", 1);
+    errno = saved;
+}
+
+/* Sleeps in poll until input is ready or the clock reaches until, forever if
+   until is negative. Window resizes and background jobs finishing arrive on
+   the wake pipe and are dealt with on the way. Returns 1 if input is ready. */
+int editor_wait(long until) {
+    for (;;) {
+        if (E.inputpos < E.inputlen) return 1;
+
+        long left = until < 0 ? -1 : until - editor_clock_ms();
+        if (until >= 0 && left < 0) left = 0;
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0},
+                                {E.wake[0], POLLIN, 0}};
+        int n = poll(fds, 2, (int)left);
+        if (n == -1 && errno != EINTR) die("poll");
+
+        if (n > 0 && fds[1].revents) {
+            char buf[64];
+            while (read(E.wake[0], buf, sizeof(buf)) > 0) {
+            }
+            if (E.resized) {
+                E.resized = 0;
+                editor_resize();
+            }
+            editor_syntax_bg_finish(0);
+            editor_grams_bg_finish(0);
+            editor_find_bg_collect();
+        }
+        // The terminal going away is reported here, its reads just find nothing
+        if (n > 0 && fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            errno = EIO;
+            die("poll");
+        }
+        if (n > 0 && fds[0].revents) return 1;
+        if (until >= 0 && editor_clock_ms() >= until) return 0;
+    }
+}
+
+/* Hands out the next input byte, reading everything the terminal has ready in
+   one go when the buffer runs dry. Waits up to timeout milliseconds for it,
+   forever if negative, and returns 0 if nothing came in time. */
+int editor_read_byte(char* c, long timeout) {
+    if (E.inputpos == E.inputlen) {
+        if (!editor_wait(timeout < 0 ? -1 : editor_clock_ms() + timeout)) {
+            return 0;
         }
+        // With VMIN and VTIME 0 a read that finds nothing returns 0
+        int nread = read(STDIN_FILENO, E.input, sizeof(E.input));
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        if (nread <= 0) return 0;
+        E.inputlen = nread;
+        E.inputpos = 0;
+    }
+    *c = E.input[E.inputpos++];
+    return 1;
+}
+
+int editor_read_key() {
+    char c;
+    // poll can report input that the read then finds gone, so wait again
+    while (!editor_read_byte(&c, -1)) {
     }
 
     if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        char seq[5];
+        if (!editor_read_byte(&seq[0], HAYAI_ESCAPE_MS)) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (!editor_read_byte(&seq[1], HAYAI_ESCAPE_MS)) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {  // Page Up & Down
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (!editor_read_byte(&seq[2], HAYAI_ESCAPE_MS)) {
                     return '\x1b';
                 }
                 if (seq[2] == '~') {
@@ -160,6 +413,14 @@ int editor_read_key() {
                         case '8':
                             return END_KEY;
                     }
+                } else if (seq[1] == '2' && seq[2] == '0') {
+                    // Bracketed paste markers, ESC [ 200~ and ESC [ 201~
+                    if (!editor_read_byte(&seq[3], HAYAI_ESCAPE_MS) ||
+                        !editor_read_byte(&seq[4], HAYAI_ESCAPE_MS)) {
+                        return '\x1b';
+                    }
+                    if (seq[4] == '~' && seq[3] == '0') return PASTE_START;
+                    if (seq[4] == '~' && seq[3] == '1') return PASTE_END;
                 }
             } else {
                 switch (seq[1]) {  // Arrow keys
@@ -200,7 +461,7 @@ int get_cursor_pos(int* rows, int* cols) {
     }
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        if (!editor_read_byte(&buf[i], HAYAI_ESCAPE_MS)) {
             break;
         }
         if (buf[i] == 'R') {
@@ -238,53 +499,159 @@ int get_window_size(int* rows, int* cols) {
 }
 
 /* SYNTAX HIGHLIGHTING */
-int is_seperator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+static const unsigned char seperators[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1,
+    ['\r'] = 1, [','] = 1, ['.'] = 1,  ['('] = 1,  [')'] = 1,  ['+'] = 1,
+    ['-'] = 1,  ['/'] = 1, ['*'] = 1,  ['='] = 1,  ['~'] = 1,  ['%'] = 1,
+    ['<'] = 1,  ['>'] = 1, ['['] = 1,  [']'] = 1,  [';'] = 1,
+};
+
+int is_seperator(int c) { return seperators[(unsigned char)c]; }
+
+// Whether a row's highlighting can depend on the rows above it
+int editor_syntax_multi_line() {
+    return E.syntax && E.syntax->multi_line_comment_start &&
+           E.syntax->multi_line_comment_end;
+}
+
+// Appends len characters of class hl to the slot's spans
+void editor_hl_push(struct render_slot* slot, int len, unsigned char hl) {
+    struct hl_span* last = slot->nhl ? &slot->hl[slot->nhl - 1] : NULL;
+    if (last && last->hl == hl) {
+        last->len += len;
+        return;
+    }
+
+    int start = last ? last->start + last->len : 0;
+    if (slot->nhl == slot->hlcap) {
+        slot->hlcap = slot->hlcap ? slot->hlcap * 2 : 8;
+        slot->hl = realloc(slot->hl, sizeof(struct hl_span) * slot->hlcap);
+    }
+    slot->hl[slot->nhl++] = (struct hl_span){start, len, hl};
 }
 
-void editor_update_syntax(erow* row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+// State the lexer starts a row in, inside a block comment if open is set
+struct hl_state editor_lex_start(int open) {
+    struct hl_state st = {0, 0, 1, HL_NORMAL};
+    st.comment = editor_syntax_multi_line() && open;
+    return st;
+}
+
+// Whether two states lex what follows them the same way
+int editor_lex_same(struct hl_state a, struct hl_state b) {
+    return a.comment == b.comment && a.string == b.string && a.sep == b.sep &&
+           a.hl == b.hl;
+}
+
+/* How far past a byte the lexer may look to decide what the byte is, so a
+   change can affect the classes of bytes up to this far before it. */
+int editor_lex_reach() {
+    if (E.syntax == NULL) return 0;
+    char* delims[] = {E.syntax->single_line_comment_start,
+                      E.syntax->multi_line_comment_start,
+                      E.syntax->multi_line_comment_end};
+    int reach = E.syntax->kw->maxlen + 1;  // keywords need a separator after
+    for (int i = 0; i < 3; i++) {
+        int len = delims[i] ? strlen(delims[i]) : 0;
+        if (len > reach) reach = len;
+    }
+    return reach < 2 ? 2 : reach;  // escapes are two bytes
+}
+
+// Sets the class of the next len bytes, spans are only kept if slot is given
+void editor_lex_push(struct render_slot* slot, struct hl_state* st, int len,
+                     unsigned char hl) {
+    st->hl = hl;
+    if (slot) editor_hl_push(slot, len, hl);
+}
 
-    if (E.syntax == NULL) return;
+/* Lexes the row text s from i up to stop, carrying on from *st, and returns
+   where it stopped. That can be past stop when a token runs over it, tokens
+   are finished by looking at bytes up to len. Runs of comment, string and
+   plain bytes are cut at stop, so lexing a row in pieces gives the same
+   classes as lexing it whole. */
+int editor_lex(const char* s, int i, int stop, int len, struct hl_state* st,
+               struct render_slot* slot) {
+    if (i >= stop) return i;
+    if (E.syntax == NULL || st->comment == 2) {
+        editor_lex_push(slot, st, stop - i, E.syntax ? HL_COMMENT : HL_NORMAL);
+        return stop;
+    }
 
-    char** keywords = E.syntax->keywords;
+    struct kwtable* kw = E.syntax->kw;
 
     char* scs = E.syntax->single_line_comment_start;
+    char* mcs = E.syntax->multi_line_comment_start;
+    char* mce = E.syntax->multi_line_comment_end;
     int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    // Runs of word bytes or spaces can be skipped in bulk unless a comment
+    // could start inside one
+    int bulk = (!scs_len || (scs[0] != ' ' && !scan_word(scs, 1))) &&
+               (!mcs_len || (mcs[0] != ' ' && !scan_word(mcs, 1)));
+
+    while (i < stop) {
+        char c = s[i];
+
+        if (st->comment) {
+            char* end = memmem(&s[i], len - i, mce, mce_len);
+            if (end == NULL || end - s >= stop) {
+                editor_lex_push(slot, st, stop - i, HL_COMMENT);
+                return stop;
+            }
+            int n = end - &s[i] + mce_len;
+            editor_lex_push(slot, st, n, HL_COMMENT);
+            i += n;
+            st->comment = 0;
+            st->sep = 1;
+            continue;
+        }
 
-    int prev_sep = 1;
-    int in_string = 0;
-
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        if (scs_len && !st->string && c == scs[0]) {
+            if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) {
+                // the rest of the row is comment
+                editor_lex_push(slot, st, stop - i, HL_COMMENT);
+                st->comment = 2;
+                return stop;
+            }
+        }
 
-        if (scs_len && !in_string) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+        if (mcs_len && mce_len && !st->string && c == mcs[0]) {
+            if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+                editor_lex_push(slot, st, mcs_len, HL_COMMENT);
+                i += mcs_len;
+                st->comment = 1;
+                continue;
             }
         }
 
         // String Highlighting
         if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + i < row->rsize) {  // escaped quotes
-                    row->hl[i + 1] = HL_STRING;
+            if (st->string) {
+                if (c == '\\' && i + 1 < len) {  // escaped quotes
+                    editor_lex_push(slot, st, 2, HL_STRING);
                     i += 2;
                     continue;
                 }
-                if (c == in_string) in_string = 0;
+                if (c != st->string && c != '\\') {
+                    // everything up to the closing quote or an escape
+                    int run = scan_until2(&s[i], stop - i, st->string, '\\');
+                    editor_lex_push(slot, st, run, HL_STRING);
+                    i += run;
+                    st->sep = 1;
+                    continue;
+                }
+                editor_lex_push(slot, st, 1, HL_STRING);
+                if (c == st->string) st->string = 0;
                 i++;
-                prev_sep = 1;
+                st->sep = 1;
                 continue;
             } else {
                 if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
+                    st->string = c;
+                    editor_lex_push(slot, st, 1, HL_STRING);
                     i++;
                     continue;
                 }
@@ -293,38 +660,94 @@ void editor_update_syntax(erow* row) {
 
         // Number Highlighting
         if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+            if ((isdigit(c) && (st->sep || st->hl == HL_NUMBER)) ||
+                (c == '.' && st->hl == HL_NUMBER)) {
+                editor_lex_push(slot, st, 1, HL_NUMBER);
                 i++;
-                prev_sep = 0;
+                st->sep = 0;
                 continue;
             }
         }
 
-        // Keywords
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_seperator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KW2 : HL_KW1, klen);
-                    i += klen;
-                    break;
-                }
+        // Keywords, a word is a keyword only if it is followed by a separator
+        if (st->sep) {
+            int klen = 0;
+            while (i + klen < len && klen <= kw->maxlen &&
+                   !is_seperator(s[i + klen])) {
+                klen++;
             }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
+            int hl = kw_lookup(kw, &s[i], klen);
+            if (hl != HL_NORMAL) {
+                editor_lex_push(slot, st, klen, hl);
+                i += klen;
+                st->sep = 0;
                 continue;
             }
         }
-        prev_sep = is_seperator(c);
+        st->sep = is_seperator(c);
+        i++;
+
+        /* After a plain byte the rest of a word (digits included) can't start
+           a number or keyword, and spaces after a separator stay plain too. */
+        int run = 0;
+        if (bulk) {
+            run = st->sep ? scan_blank(&s[i], stop - i)
+                          : scan_word(&s[i], stop - i);
+        }
+        editor_lex_push(slot, st, 1 + run, HL_NORMAL);
+        i += run;
+    }
+    return i;
+}
+
+/* Returns whether a row that starts inside a block comment if open is set ends
+   in one. Follows the rules of editor_update_syntax without building spans,
+   and only reads syntax, so it is safe to call off the main thread. */
+int editor_syntax_end_state(struct editor_syntax* syntax, const char* s,
+                            int len, int open) {
+    char* scs = syntax->single_line_comment_start;
+    char* mcs = syntax->multi_line_comment_start;
+    char* mce = syntax->multi_line_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = strlen(mcs);
+    int mce_len = strlen(mce);
+    int strings = syntax->flags & HL_HIGHLIGHT_STRINGS;
+
+    int i = 0;
+    while (i < len) {
+        if (open) {
+            char* end = memmem(&s[i], len - i, mce, mce_len);
+            if (end == NULL) return 1;
+            i = end - s + mce_len;
+            open = 0;
+            continue;
+        }
+
+        char c = s[i];
+        if (scs_len && c == scs[0] && i + scs_len <= len &&
+            !memcmp(&s[i], scs, scs_len)) {
+            return 0;
+        }
+        if (c == mcs[0] && i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+            i += mcs_len;
+            open = 1;
+            continue;
+        }
+
         i++;
+        if (strings && (c == '"' || c == '\'')) {
+            while (i < len) {  // strings end with the row if left open
+                i += scan_until2(&s[i], len - i, c, '\\');
+                if (i == len) break;
+                if (s[i] == c) {
+                    i++;
+                    break;
+                }
+                i += (i + 1 < len) ? 2 : 1;  // escaped character
+            }
+        }
     }
+    return 0;
 }
 
 int editor_syntax_to_colour(int hl) {
@@ -347,6 +770,7 @@ int editor_syntax_to_colour(int hl) {
 }
 
 void editor_select_syntax_highlight() {
+    editor_syntax_bg_drop();
     E.syntax = NULL;
     if (E.filename == NULL) return;
 
@@ -359,10 +783,14 @@ void editor_select_syntax_highlight() {
             if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
                 (!is_ext && strstr(E.filename, s->filematch[j]))) {
                 E.syntax = s;
+                if (s->kw == NULL) s->kw = kw_compile(s->keywords);
+                E.hl_known = 0;
 
-                for (int filerow = 0; filerow < E.numrows; filerow++) {
-                    editor_update_syntax(&E.row[filerow]);
+                // rows are highlighted again as they come into view
+                for (int i = 0; i < E.rcache_len; i++) {
+                    E.rcache[i].owner = 0;
                 }
+                editor_syntax_bg_start();
                 return;
             }
             j++;
@@ -370,227 +798,1310 @@ void editor_select_syntax_highlight() {
     }
 }
 
+/* RENDER CACHE */
+
+/* Returns the cache slot for row. A row without one takes the first slot the
+   clock hand finds free or unused since its last pass, so finding a victim
+   does not cost a walk over the whole cache. */
+struct render_slot* editor_render_slot(erow* row) {
+    if (row->rslot >= 0 && E.rcache[row->rslot].owner == row->id) {
+        return &E.rcache[row->rslot];
+    }
+    if (row->id == 0) row->id = ++E.rowids;
+
+    int victim;
+    for (;;) {
+        victim = E.rhand;
+        E.rhand = (E.rhand + 1) % E.rcache_len;
+        struct render_slot* s = &E.rcache[victim];
+        if (s->owner == 0 || !s->ref) break;
+        s->ref = 0;
+    }
+
+    E.rcache[victim].owner = row->id;
+    E.rcache[victim].nmarks = 0;
+    E.rcache[victim].dirty = -1;
+    row->rslot = victim;
+    row->stale = 1;
+    return &E.rcache[victim];
+}
+
+void editor_render_release(erow* row) {
+    if (row->rslot >= 0 && E.rcache[row->rslot].owner == row->id) {
+        E.rcache[row->rslot].owner = 0;
+    }
+    row->rslot = -1;
+}
+
 /* ROW OPERATIONS */
 
-int editor_cx_to_rx(erow* row, int cx) {
-    int rx = 0;
-    for (int i = 0; i < cx; i++) {
-        if (row->chars[i] == '\t') {
-            rx += (HAYAI_TAB_STOP - 1) - (rx % HAYAI_TAB_STOP);
+// Copies characters [from, to) of row into dst, skipping over the gap
+void editor_row_copy(erow* row, int from, int to, char* dst) {
+    if (from < row->gap) {
+        int len = (to < row->gap ? to : row->gap) - from;
+        memcpy(dst, &row->chars[from], len);
+        dst += len;
+        from += len;
+    }
+    if (from < to) {
+        memcpy(dst, &row->chars[from + row->gaplen], to - from);
+    }
+}
+
+/* Returns characters [from, to) of row in one piece. They are read in place
+   unless the gap splits them, then they are copied into E.lexbuf. */
+const char* editor_row_text(erow* row, int from, int to) {
+    if (to <= row->gap) return &row->chars[from];
+    if (from >= row->gap) return &row->chars[from + row->gaplen];
+
+    if (to - from > E.lexcap) {
+        E.lexcap = E.lexcap ? E.lexcap : 256;
+        while (E.lexcap < to - from) E.lexcap *= 2;
+        E.lexbuf = realloc(E.lexbuf, E.lexcap);
+    }
+    editor_row_copy(row, from, to, E.lexbuf);
+    return E.lexbuf;
+}
+
+// Returns the render column after len characters of s that start at column
+// rx, counting the tabs among them into tabs if given
+int editor_text_width(const char* s, int len, int rx, int* tabs) {
+    const char* end = s + len;
+    const char* t;
+    int n = 0;
+    while ((t = memchr(s, '\t', end - s)) != NULL) {
+        rx += t - s;
+        rx += HAYAI_TAB_STOP - (rx % HAYAI_TAB_STOP);
+        s = t + 1;
+        n++;
+    }
+    if (tabs) *tabs = n;
+    return rx + (end - s);
+}
+
+// Index of the last mark at or before chars index cx, or render column rx
+int editor_mark_find(struct render_slot* slot, int cx, int rx) {
+    int lo = 0, hi = slot->nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        struct row_mark* m = &slot->marks[mid];
+        if (cx >= 0 ? m->cx <= cx : m->rx <= rx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
-        rx++;
     }
-    return rx;
+    return lo;
+}
+
+/* Both conversions start from the closest mark of the row's render slot, so
+   the row must have come from editor_row_rendered. */
+int editor_cx_to_rx(erow* row, int cx) {
+    struct render_slot* slot = &E.rcache[row->rslot];
+    struct row_mark* m = &slot->marks[editor_mark_find(slot, cx, 0)];
+    const char* s = editor_row_text(row, m->cx, cx);
+    return editor_text_width(s, cx - m->cx, m->rx, NULL);
 }
 
 int editor_rx_to_cx(erow* row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (HAYAI_TAB_STOP - 1) - (cur_rx % HAYAI_TAB_STOP);
-        cur_rx++;
+    struct render_slot* slot = &E.rcache[row->rslot];
+    int k = editor_mark_find(slot, -1, rx);
+    int cx = slot->marks[k].cx;
+    int cur_rx = slot->marks[k].rx;
+    int end = (k + 1 < slot->nmarks) ? slot->marks[k + 1].cx : row->size;
+
+    const char* s = editor_row_text(row, cx, end);
+    for (int i = 0; i < end - cx; i++) {
+        int next = (s[i] == '\t')
+                       ? cur_rx + HAYAI_TAB_STOP - (cur_rx % HAYAI_TAB_STOP)
+                       : cur_rx + 1;
+        if (next > rx) return cx + i;  // rx falls on this character
+        cur_rx = next;
+    }
+    return end;
+}
+
+/* Expands the tabs of the len characters in s, which start at render column
+   rx, into the slot's render and moves its spans from characters to render
+   columns. s is used as it is when it has no tabs and is not E.lexbuf. */
+void editor_render_window(erow* row, struct render_slot* slot, const char* s,
+                          int len, int rx) {
+    int tabs;
+    int rlen = editor_text_width(s, len, rx, &tabs) - rx;
+    slot->wrx = rx;
+    slot->wrlen = rlen;
+
+    if (tabs == 0 && s != E.lexbuf) {
+        row->render = (char*)s;
+        return;
+    }
+    if (rlen + 1 > slot->rendercap) {
+        slot->rendercap = slot->rendercap ? slot->rendercap : 64;
+        while (slot->rendercap < rlen + 1) slot->rendercap *= 2;
+        slot->render = realloc(slot->render, slot->rendercap);
+    }
+    row->render = slot->render;
+
+    int idx = 0;
+    int from = 0;
+    for (int k = 0; k < slot->nhl; k++) {
+        struct hl_span* span = &slot->hl[k];
+        int to = from + span->len;
+        span->start = idx;
+        while (from < to) {
+            const char* t = memchr(&s[from], '\t', to - from);
+            int n = (t ? t - s : to) - from;
+            memcpy(&row->render[idx], &s[from], n);
+            idx += n;
+            from += n;
+            if (t) {
+                row->render[idx++] = ' ';
+                while ((rx + idx) % HAYAI_TAB_STOP != 0) row->render[idx++] = ' ';
+                from++;
+            }
+        }
+        span->len = idx - span->start;
+    }
+    row->render[idx] = '\0';
+}
 
-        if (cur_rx > rx) return cx;
+/* Notes that the characters of row from at onwards moved by delta, with
+   [at, at + delta) inserted or [at, at - delta) deleted. The marks of a long
+   row are moved along so it can be lexed again around the change only. */
+void editor_row_changed(erow* row, int at, int delta) {
+    row->stale = 1;
+    if (row->rslot < 0 || E.rcache[row->rslot].owner != row->id) return;
+
+    struct render_slot* slot = &E.rcache[row->rslot];
+    for (int k = slot->nmarks - 1; k >= 0 && slot->marks[k].cx > at; k--) {
+        int cx = slot->marks[k].cx + delta;
+        slot->marks[k].cx = cx > at ? cx : at;
     }
-    return cx;
+
+    // A mark left at a deletion has new text after it, so it is not reused
+    int end = at + (delta > 0 ? delta : 1);
+    if (slot->dirty < 0) {
+        slot->dirty = at;
+        slot->dirty_end = end;
+        return;
+    }
+    if (slot->dirty_end > at) {
+        slot->dirty_end += delta;
+        if (slot->dirty_end < at) slot->dirty_end = at;
+    }
+    if (at < slot->dirty) slot->dirty = at;
+    if (end > slot->dirty_end) slot->dirty_end = end;
 }
 
-void editor_update_row(erow* row) {
-    int tabs = 0;
-    for (int i = 0; i < row->size; i++) {  // Count tabs
-        if (row->chars[i] == '\t') {
-            tabs++;
+/* Lexes a long row again from the last mark safely before its change, laying
+   new marks until it reaches an old one past the change in the same state.
+   Everything after that one lexes as before, only moved along. */
+void editor_row_remark(erow* row, struct render_slot* slot) {
+    int reach = editor_lex_reach();
+    // Marks the change moved together are only trusted strictly before it
+    int from = slot->dirty - reach;
+    int w = (from > 0) ? editor_mark_find(slot, from - 1, 0) + 1 : 1;
+    int j = w;  // first old mark not yet passed
+    struct hl_state st = slot->marks[w - 1].st;
+    int pos = slot->marks[w - 1].cx;
+    int rx = slot->marks[w - 1].rx;
+
+    for (;;) {
+        while (j < slot->nmarks && slot->marks[j].cx <= pos) j++;
+        int stop = (j < slot->nmarks) ? slot->marks[j].cx : row->size;
+        if (stop - pos > 2 * HAYAI_ROW_MARK) stop = pos + HAYAI_ROW_MARK;
+
+        int len = (stop + reach < row->size ? stop + reach : row->size) - pos;
+        const char* s = editor_row_text(row, pos, pos + len);
+        int end = editor_lex(s, 0, stop - pos, len, &st, NULL);
+        rx = editor_text_width(s, end, rx, &slot->marks[w - 1].tabs);
+        pos += end;
+
+        if (pos >= row->size) {
+            slot->nmarks = w;
+            row->rsize = rx;
+            row->hl_open = st.comment == 1;
+            break;
+        }
+
+        if (j < slot->nmarks && slot->marks[j].cx == pos &&
+            pos >= slot->dirty_end && editor_lex_same(slot->marks[j].st, st)) {
+            // Tabs after here keep their width if it moved by whole tab stops
+            int d = rx - slot->marks[j].rx;
+            int tabs = 0;
+            for (int k = j; k < slot->nmarks; k++) tabs += slot->marks[k].tabs;
+            if (d % HAYAI_TAB_STOP == 0 || tabs == 0) {
+                for (int k = j; k < slot->nmarks; k++) slot->marks[k].rx += d;
+                row->rsize += d;
+                memmove(&slot->marks[w], &slot->marks[j],
+                        sizeof(struct row_mark) * (slot->nmarks - j));
+                slot->nmarks -= j - w;
+                break;
+            }
+        }
+
+        if (w == j) {  // no old mark left to reuse, make room for one
+            if (slot->nmarks == slot->markcap) {
+                slot->markcap = slot->markcap ? slot->markcap * 2 : 16;
+                slot->marks = realloc(slot->marks,
+                                      sizeof(struct row_mark) * slot->markcap);
+            }
+            memmove(&slot->marks[w + 1], &slot->marks[w],
+                    sizeof(struct row_mark) * (slot->nmarks - w));
+            slot->nmarks++;
+            j++;
         }
+        slot->marks[w++] = (struct row_mark){pos, rx, 0, st};
+    }
+    slot->dirty = -1;
+}
+
+/* Renders the part of a long row the view is on, from the last mark before
+   it to the first mark past it. */
+void editor_row_window(erow* row, struct render_slot* slot) {
+    int reach = editor_lex_reach();
+    int m = editor_mark_find(slot, -1, E.coloff);
+    int n = m + 1;
+    while (n < slot->nmarks && slot->marks[n].rx < E.coloff + E.screencols) {
+        n++;
     }
+    int from = slot->marks[m].cx;
+    int stop = (n < slot->nmarks) ? slot->marks[n].cx : row->size;
+
+    int len = (stop + reach < row->size ? stop + reach : row->size) - from;
+    const char* s = editor_row_text(row, from, from + len);
+    struct hl_state st = slot->marks[m].st;
+    slot->nhl = 0;
+    int end = editor_lex(s, 0, stop - from, len, &st, slot);
+
+    slot->wcx = from;
+    slot->wend = from + end;
+    editor_render_window(row, slot, s, end, slot->marks[m].rx);
+}
 
-    free(row->render);
-    /* Tabs are 8 characters long, 1 character out of 8 is already counted for
-       in row->size, hence tabs * 7*/
-    row->render = malloc(row->size + tabs * (HAYAI_TAB_STOP - 1) + 1);
+void editor_update_row(erow* row, int open) {
+    struct render_slot* slot = editor_render_slot(row);
+    struct hl_state st = editor_lex_start(open);
 
-    int idx = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % HAYAI_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[i];
+    if (slot->markcap == 0) {
+        slot->markcap = 16;
+        slot->marks = malloc(sizeof(struct row_mark) * slot->markcap);
+    }
+
+    if (row->size <= 2 * HAYAI_ROW_MARK) {
+        // Short rows are lexed and rendered whole, with a single mark
+        const char* s = editor_row_text(row, 0, row->size);
+        slot->nhl = 0;
+        slot->marks[0] = (struct row_mark){0, 0, 0, st};
+        slot->nmarks = 1;
+        slot->dirty = -1;
+        editor_lex(s, 0, row->size, row->size, &st, slot);
+        row->hl_open = st.comment == 1;
+
+        slot->wcx = 0;
+        slot->wend = row->size;
+        editor_render_window(row, slot, s, row->size, 0);
+        row->rsize = slot->wrlen;
+    } else {
+        if (slot->nmarks == 0) {
+            slot->marks[0] = (struct row_mark){0, 0, 0, st};
+            slot->nmarks = 1;
+            slot->dirty = 0;
+            slot->dirty_end = row->size;
+        } else if (!editor_lex_same(slot->marks[0].st, st)) {
+            slot->marks[0].st = st;  // the row above changed how this starts
+            editor_row_changed(row, 0, 0);
         }
+        if (slot->dirty >= 0) editor_row_remark(row, slot);
+        editor_row_window(row, slot);
     }
+    row->stale = 0;
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    editor_update_syntax(row);
+// Moves the gap so it starts at logical index at
+void editor_row_move_gap(erow* row, int at) {
+    if (at < row->gap) {
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+    } else if (at > row->gap) {
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen],
+                at - row->gap);
+    }
+    row->gap = at;
+}
+
+/* Makes sure the gap can take len more characters. A row still sharing the
+   file buffer is copied into the text arena first, so this is also how rows
+   are made writable. Arena blocks are powers of two, which keeps regrowth
+   geometric. */
+void editor_row_grow_gap(erow* row, int len) {
+    if (row->gaplen >= len && !row->shared) return;
+
+    size_t cap;
+    char* chars = arena_alloc(&E.text, row->size + len, &cap);
+    int tail = row->size - row->gap;
+    memcpy(chars, row->chars, row->gap);
+    memcpy(&chars[cap - tail], &row->chars[row->gap + row->gaplen], tail);
+
+    if (!row->shared) {
+        arena_release(&E.text, row->chars, row->size + row->gaplen);
+    }
+    row->chars = chars;
+    row->gaplen = cap - row->size;
+    row->shared = 0;
+}
+
+// Moves the gap to the end so chars can be read as one run
+char* editor_row_close_gap(erow* row) {
+    editor_row_move_gap(row, row->size);
+    return row->chars;
+}
+
+// Adds a row without lexing it, see editor_insert_row
+void editor_new_row(int at, char* s, size_t len) {
+    size_t cap;
+    erow* row = rope_insert(&E.rows, at);
+    row->size = len;
+    row->chars = arena_alloc(&E.text, len, &cap);
+    memcpy(row->chars, s, len);
+    row->gap = len;
+    row->gaplen = cap - len;
+    row->shared = 0;
+    row->stale = 1;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->id = 0;
+    row->rslot = -1;
+    row->hl_open = -1;
+
+    E.numrows++;
+    E.dirty++;
+    if (at < E.hl_known) E.hl_known++;
+    editor_grams_note(at, 0, len);
 }
 
 void editor_insert_row(int at, char* s, size_t len) {
     if (at < 0 || at > E.numrows) return;
+    editor_new_row(at, s, len);
+    editor_update_syntax_from(at);
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+erow* editor_row(int at) { return rope_get(&E.rows, at); }
+
+/* Same as editor_row, with render and highlighting brought up to date.
+   They are built on demand and kept in the render cache until evicted. */
+erow* editor_row_rendered(int at) {
+    int open = 0;
+    if (editor_syntax_multi_line()) {
+        // Rows above are lexed first to learn the state this one starts in,
+        // far below them the pool will likely get there sooner
+        if (at - E.hl_known > E.screenrows) editor_syntax_bg_finish(1);
+        while (E.hl_known < at) editor_row_rendered(E.hl_known);
+        if (at > 0) open = editor_row(at - 1)->hl_open;
+    }
+
+    erow* row = editor_row(at);
+    if (row->rslot < 0 || E.rcache[row->rslot].owner != row->id ||
+        row->stale) {
+        editor_update_row(row, open);
+    } else {
+        // A long row is only rendered around the view, which may have moved
+        struct render_slot* slot = &E.rcache[row->rslot];
+        if (slot->wrx > E.coloff ||
+            (slot->wend < row->size &&
+             slot->wrx + slot->wrlen < E.coloff + E.screencols)) {
+            editor_row_window(row, slot);
+        }
+    }
+    E.rcache[row->rslot].ref = 1;
+    if (at == E.hl_known) E.hl_known++;
+    return row;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+/* Lexes rows again from at downwards after an edit, stopping at the first one
+   that ends in the same state as before, since rows below it are unaffected.
+   Rows that were never lexed are left for editor_row_rendered. */
+void editor_update_syntax_from(int at) {
+    if (E.hljob && at < E.hljob->limit) E.hljob->limit = at;
+    if (!editor_syntax_multi_line()) return;
+
+    for (int i = at; i < E.hl_known; i++) {
+        erow* row = editor_row(i);
+        int old = row->hl_open;
+        row->stale = 1;
+        editor_row_rendered(i);
+        if (row->hl_open == old) return;
+    }
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    editor_update_row(&E.row[at]);
+// Renders rows just outside the window so short scrolls find them cached
+void editor_prefetch_rows() {
+    int start = E.rowoff - HAYAI_PREFETCH_ROWS;
+    int end = E.rowoff + E.screenrows + HAYAI_PREFETCH_ROWS;
+    if (start < 0) start = 0;
+    if (end > E.numrows) end = E.numrows;
 
-    E.numrows++;
-    E.dirty++;
+    for (int i = start; i < end; i++) {
+        editor_row_rendered(i);
+    }
 }
 
 void editor_free_row(erow* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    editor_render_release(row);
+    if (!row->shared) {
+        arena_release(&E.text, row->chars, row->size + row->gaplen);
+    }
 }
 
 void editor_del_row(int at) {
-    if (at < 0 || at >= E.numrows) at = E.numrows;
-    editor_free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    if (at < 0 || at >= E.numrows) return;
+    editor_free_row(rope_get(&E.rows, at));
+    rope_delete(&E.rows, at);
     E.numrows--;
     E.dirty++;
+    if (at < E.hl_known) E.hl_known--;
+    editor_update_syntax_from(at);
 }
 
+/* Character edits only move the gap to the cursor, render and highlighting are
+   rebuilt once the row is next drawn. */
 void editor_row_insert_char(erow* row, int at, char c) {
-    if (at < 0 || at > row->size) at = row->size;     // oob check
-    row->chars = realloc(row->chars, row->size + 2);  // room for null byte
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    if (at < 0 || at > row->size) at = row->size;  // oob check
+    editor_row_grow_gap(row, 1);
+    editor_row_move_gap(row, at);
+    row->chars[row->gap++] = c;
+    row->gaplen--;
     row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
+    editor_row_changed(row, at, 1);
 
     E.dirty++;
 }
 
-void editor_row_append_string(erow* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
+void editor_row_insert_string(erow* row, int at, const char* s, int len) {
+    editor_row_grow_gap(row, len);
+    editor_row_move_gap(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->gaplen -= len;
     row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
+    editor_row_changed(row, at, len);
     E.dirty++;
 }
 
+void editor_row_append_string(erow* row, char* s, size_t len) {
+    editor_row_insert_string(row, row->size, s, len);
+}
+
 void editor_row_delete_char(erow* row, int at) {
     if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    editor_row_grow_gap(row, 0);  // file buffer rows are read only
+    editor_row_move_gap(row, at + 1);
+    row->gap--;
+    row->gaplen++;
     row->size--;
-    editor_update_row(row);
+    editor_row_changed(row, at, -1);
     E.dirty++;
 }
 
-/* EDITOR OPERATIONS */
+void editor_row_delete_string(erow* row, int at, int len) {
+    editor_row_grow_gap(row, 0);
+    editor_row_move_gap(row, at + len);
+    row->gap -= len;
+    row->gaplen += len;
+    row->size -= len;
+    editor_row_changed(row, at, -len);
+    E.dirty++;
+}
 
-void editor_insert_char(int c) {
-    if (E.cy == E.numrows) {  // At EOF
-        editor_insert_row(E.numrows, "", 0);
+// Breaks row at in two at cx, the rest of it going to a new row below
+void editor_split_row(int at, int cx) {
+    if (cx == 0) {
+        editor_insert_row(at, "", 0);
+        return;
     }
-    editor_row_insert_char(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    erow* row = editor_row(at);
+    char* chars = editor_row_close_gap(row);
+    editor_insert_row(at + 1, &chars[cx], row->size - cx);
+    row = rope_get(&E.rows, at);
+    if (!row->shared) {
+        row->gaplen += row->size - cx;  // the moved tail joins the gap
+    }
+    editor_row_changed(row, cx, cx - row->size);
+    row->gap = row->size = cx;
+    editor_update_syntax_from(at);
 }
 
-void editor_insert_new_line() {
-    if (E.cx == 0) {
-        editor_insert_row(E.cy, "", 0);
-    } else {
-        erow* row = &E.row[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
-    }
-    E.cy++;
-    E.cx = 0;
+// Appends the row below at to it
+void editor_join_row(int at) {
+    erow* row = editor_row(at + 1);
+    int cx = editor_row(at)->size;
+    editor_row_append_string(editor_row(at), editor_row_close_gap(row),
+                             row->size);
+    editor_grams_note(at, cx, cx + row->size);
+    editor_del_row(at + 1);
+    editor_update_syntax_from(at);
 }
 
-void editor_del_char() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+/* Puts with in place of the n matches m of row, which are in order and do not
+   overlap. The new text is built in one pass into a block of its own, however
+   many matches there are. */
+void editor_row_replace(erow* row, struct find_match* m, int n,
+                        const char* with, int wlen) {
+    int size = row->size;
+    for (int k = 0; k < n; k++) size += wlen - m[k].len;
+
+    size_t cap;
+    char* chars = arena_alloc(&E.text, size, &cap);
+    int from = 0;
+    char* p = chars;
+    for (int k = 0; k < n; k++) {
+        editor_row_copy(row, from, m[k].cx, p);
+        p += m[k].cx - from;
+        memcpy(p, with, wlen);
+        p += wlen;
+        from = m[k].cx + m[k].len;
+    }
+    editor_row_copy(row, from, row->size, p);
 
-    erow* row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editor_row_delete_char(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+    if (!row->shared) {
+        arena_release(&E.text, row->chars, row->size + row->gaplen);
     }
+    int first = m[0].cx;
+    int last = from;  // end of the text replaced
+    int delta = size - row->size;
+    row->chars = chars;
+    row->size = size;
+    row->gap = size;
+    row->gaplen = cap - size;
+    row->shared = 0;
+
+    // The span from the first match to the last is deleted and inserted anew
+    editor_row_changed(row, first, first - last);
+    editor_row_changed(row, first, last + delta - first);
+    E.dirty++;
 }
 
-/* FILE I/O */
+/* BACKGROUND LEXING */
 
-char* editor_row_to_string(int* buflen) {
-    int total_len = 0;
-    for (int i = 0; i < E.numrows; i++) {
-        total_len += E.row[i].size + 1;  //+1 for nl character
+// The worker pool, started the first time it is needed
+struct pool* editor_pool() {
+    if (E.pool == NULL) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        E.pool = pool_new(n > 1 ? n : 1);
     }
-    *buflen = total_len;
+    return E.pool;
+}
 
-    char* buf = malloc(total_len);  // function caller will free memory
-    char* p = buf;
-    for (int i = 0; i < E.numrows; i++) {
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
-    }
+void editor_syntax_lex_chunk(void* arg) {
+    struct hl_chunk* c = arg;
+    char* mce = c->syntax->multi_line_comment_end;
+    const char* close = NULL;  // next comment end at or after the row
+    int cap = 0;
+    int open[2] = {0, 1};  // both states the chunk might start in
+
+    for (const char* p = c->start; p < c->end; c->nrows++) {
+        const char* nl = memchr(p, '\n', c->end - p);
+        const char* eol = nl ? nl : c->end;
+        while (eol > p && eol[-1] == '\r') eol--;
+
+        if (c->nrows == cap) {
+            cap = cap ? cap * 2 : 1024;
+            c->ends = realloc(c->ends, cap);
+        }
 
-    return buf;
+        // Until both states meet each row is lexed twice
+        int met = open[0] == open[1];
+        for (int s = 0; s < (met ? 1 : 2); s++) {
+            if (open[s]) {
+                // Rows before the next comment end stay inside the comment
+                if (close == NULL || close < p) {
+                    close = memmem(p, c->end - p, mce, strlen(mce));
+                    if (close == NULL) close = c->end;
+                }
+                if (close >= eol) continue;
+            }
+            open[s] = editor_syntax_end_state(c->syntax, p, eol - p, open[s]);
+        }
+        if (met) open[1] = open[0];
+        c->ends[c->nrows] = open[0] | open[1] << 1;
+        p = nl ? nl + 1 : c->end;
+    }
+    pool_group_done(&c->job->lexed);
 }
 
-void editor_open(char* fname) {
-    free(E.filename);
-    E.filename = strdup(fname);
+// End of about size bytes of the file buffer from p, just after a newline so
+// rows are never split
+char* editor_chunk_end(char* p, char* end, size_t size) {
+    if ((size_t)(end - p) <= size) return end;
+    char* nl = memchr(p + size, '\n', end - p - size);
+    return nl ? nl + 1 : end;
+}
 
-    editor_select_syntax_highlight();
+/* Hands the rows below E.hl_known to the worker pool in chunks of the file
+   buffer. Only called while every row still matches the buffer, small files
+   are left to editor_row_rendered. */
+void editor_syntax_bg_start() {
+    editor_syntax_bg_drop();
+    if (!editor_syntax_multi_line() || E.filebuf == NULL) return;
+
+    char* p = E.filebuf;
+    char* end = E.filebuf + E.filebuf_len;
+    for (int i = 0; i < E.hl_known && p < end; i++) {
+        char* nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    if (end - p < HAYAI_SYNTAX_CHUNK) return;
+
+    struct hl_job* job = calloc(1, sizeof(struct hl_job));
+    job->first = E.hl_known;
+    job->open = E.hl_known ? editor_row(E.hl_known - 1)->hl_open : 0;
+    job->limit = E.numrows;
+
+    int cap = 0;
+    while (p < end) {
+        char* stop = editor_chunk_end(p, end, HAYAI_SYNTAX_CHUNK);
+        if (job->nchunks == cap) {
+            cap = cap ? cap * 2 : 16;
+            job->chunks = realloc(job->chunks, sizeof(struct hl_chunk) * cap);
+        }
+        job->chunks[job->nchunks++] =
+            (struct hl_chunk){job, p, stop, E.syntax, 0, NULL};
+        p = stop;
+    }
 
-    FILE* fp = fopen(fname, "r");
-    if (!fp) {
-        die("fopen");
+    pool_group_init(&job->lexed, job->nchunks, E.wake[1]);
+    for (int i = 0; i < job->nchunks; i++) {
+        pool_submit(editor_pool(), editor_syntax_lex_chunk, &job->chunks[i]);
     }
+    E.hljob = job;
+}
 
-    char* line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len;
-    while (((line_len = getline(&line, &line_cap, fp)) != -1)) {
-        while (line_len > 0 &&
-               (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-            line_len--;
+/* Chains the chunks' end states together and stores them in the rows that
+   have not changed since, moving E.hl_known past them. Does nothing while
+   chunks are still being lexed, unless wait is set. */
+void editor_syntax_bg_finish(int wait) {
+    struct hl_job* job = E.hljob;
+    if (job == NULL || (!wait && !pool_group_idle(&job->lexed))) return;
+    pool_group_wait(&job->lexed);
+    pool_group_free(&job->lexed);
+
+    int row = job->first;
+    int open = job->open;
+    for (int k = 0; k < job->nchunks; k++) {
+        struct hl_chunk* c = &job->chunks[k];
+        for (int r = 0; r < c->nrows; r++, row++) {
+            open = (c->ends[r] >> open) & 1;
+            if (row >= E.hl_known && row < job->limit) {
+                editor_row(row)->hl_open = open;
+            }
         }
-        editor_insert_row(E.numrows, line, line_len);
+        free(c->ends);
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if (job->limit > E.hl_known) E.hl_known = job->limit;
+
+    free(job->chunks);
+    free(job);
+    E.hljob = NULL;
 }
 
-void editor_save() {
-    if (E.filename == NULL) {
-        E.filename = editor_prompt("Save As : %s [ESC to Cancel]", NULL);
-        if (E.filename == NULL) {
-            editor_set_status("Save Aborted");
-            return;
-        }
-        editor_select_syntax_highlight();
+// Waits out the background job without using its results
+void editor_syntax_bg_drop() {
+    if (E.hljob == NULL) return;
+    E.hljob->limit = 0;
+    editor_syntax_bg_finish(1);
+}
+
+/* SEARCH INDEX */
+
+// Returns f, or NULL once it is too full to rule out enough to pay for itself
+struct gram* editor_grams_useful(struct gram* f) {
+    if (f && gram_full(f)) {
+        free(f);
+        return NULL;
     }
+    return f;
+}
 
-    int len;
-    char* buf = editor_row_to_string(&len);
+void editor_grams_chunk(void* arg) {
+    struct gram_chunk* c = arg;
+    struct gram_job* job = c->job;
+    for (int l = c->from; l < c->to; l++) {
+        if (job->starts[l] == NULL) continue;
+        int len = job->ends[l] - job->starts[l];
+        struct gram* f = gram_new(len);
+        if (f) gram_add(f, job->starts[l], len);
+        job->grams[l] = editor_grams_useful(f);
+    }
+    pool_group_done(&job->built);
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+// Builds the filter of leaf from its rows as they are now
+struct gram* editor_grams_rows(struct rope_node* leaf) {
+    int len = 0;
+    for (int i = 0; i < leaf->count; i++) len += leaf->rows[i].size + 1;
+    struct gram* f = gram_new(len);
+    for (int i = 0; f && i < leaf->count; i++) {
+        erow* row = &leaf->rows[i];
+        gram_add(f, editor_row_text(row, 0, row->size), row->size);
+    }
+    return editor_grams_useful(f);
+}
+
+/* Returns where in E.filebuf the rows of leaf run, one after the other, and
+   sets *end to where they stop. NULL if any of them is elsewhere. */
+const char* editor_grams_text(struct rope_node* leaf, const char** end) {
+    const char* p = leaf->rows[0].chars;
+    for (int i = 0; i < leaf->count; i++) {
+        erow* row = &leaf->rows[i];
+        if (!row->shared || row->chars < p || row->chars - p > 2) return NULL;
+        p = row->chars + row->size;
+    }
+    *end = p;
+    return leaf->rows[0].chars;
+}
+
+/* Gives every leaf a trigram filter of its rows, so searches can pass over
+   the leaves that cannot hold the query. The filters of leaves still in the
+   file buffer are built from it on the pool, those of edited leaves once the
+   rest are done. Files smaller than HAYAI_GRAM_MIN_SIZE go without, they are
+   quick enough to search as they are. */
+void editor_grams_bg_start() {
+    if (E.filebuf_len < HAYAI_GRAM_MIN_SIZE || E.numrows == 0) return;
+
+    struct gram_job* job = calloc(1, sizeof(struct gram_job));
+    int start;
+    struct rope_node* first = rope_leaf(&E.rows, 0, &start);
+    for (struct rope_node* leaf = first; leaf; leaf = leaf->next) {
+        job->nleaves++;
+    }
+    job->starts = malloc(sizeof(char*) * job->nleaves);
+    job->ends = malloc(sizeof(char*) * job->nleaves);
+    job->grams = calloc(job->nleaves, sizeof(struct gram*));
+    int l = 0;
+    for (struct rope_node* leaf = first; leaf; leaf = leaf->next, l++) {
+        job->starts[l] = editor_grams_text(leaf, &job->ends[l]);
+    }
+
+    // Each task takes a run of leaves about HAYAI_FIND_CHUNK bytes long
+    int cap = 0;
+    for (int from = 0; from < job->nleaves;) {
+        int to = from;
+        long bytes = 0;
+        while (to < job->nleaves && bytes < HAYAI_FIND_CHUNK) {
+            if (job->starts[to]) bytes += job->ends[to] - job->starts[to];
+            to++;
+        }
+        if (job->nchunks == cap) {
+            cap = cap ? cap * 2 : 16;
+            job->chunks = realloc(job->chunks, sizeof(struct gram_chunk) * cap);
+        }
+        job->chunks[job->nchunks++] = (struct gram_chunk){job, from, to};
+        from = to;
+    }
+
+    pool_group_init(&job->built, job->nchunks, E.wake[1]);
+    for (int k = 0; k < job->nchunks; k++) {
+        pool_submit(editor_pool(), editor_grams_chunk, &job->chunks[k]);
+    }
+    E.gramjob = job;
+}
+
+// Frees the job along with the filters it still holds
+void editor_grams_bg_free(struct gram_job* job) {
+    for (int l = 0; l < job->nleaves; l++) free(job->grams[l]);
+    free(job->starts);
+    free(job->ends);
+    free(job->grams);
+    free(job->chunks);
+    pool_group_free(&job->built);
+    free(job);
+    E.gramjob = NULL;
+}
+
+/* Hands each filter to the leaf it was built for, if that leaf's rows are
+   still the very text it was built from. Leaves edited or merged since, and
+   those that were not in the file buffer at all, get theirs built from their
+   rows here. Reports the memory the filters take. Does nothing while chunks
+   are still being filtered, unless wait is set. */
+void editor_grams_bg_finish(int wait) {
+    struct gram_job* job = E.gramjob;
+    if (job == NULL || (!wait && !pool_group_idle(&job->built))) return;
+    pool_group_wait(&job->built);
+
+    int start;
+    struct rope_node* leaf = E.numrows ? rope_leaf(&E.rows, 0, &start) : NULL;
+    long bytes = 0;
+    int covered = 0;
+    for (int l = 0; leaf; leaf = leaf->next) {
+        const char* end;
+        const char* text = editor_grams_text(leaf, &end);
+        // Leaves keep their order, so the filter is at l or further on
+        while (text && l < job->nleaves &&
+               (job->starts[l] == NULL || job->starts[l] < text)) {
+            l++;
+        }
+        if (text && l < job->nleaves && job->starts[l] == text &&
+            job->ends[l] == end) {
+            leaf->grams = job->grams[l];  // NULL if it came out too full
+            job->grams[l++] = NULL;
+        } else {
+            leaf->grams = editor_grams_rows(leaf);
+        }
+        if (leaf->grams) {
+            bytes += gram_bytes(leaf->grams);
+            covered += leaf->count;
+        }
+    }
+    if (bytes) {
+        E.indexed = (bytes + 1023) / 1024;
+        editor_set_status("Search index built, %d KB for %d of %d rows",
+                          E.indexed, covered, E.numrows);
+    }
+
+    editor_grams_bg_free(job);
+    if (!wait) editor_refresh_screen();  // the prompt may be showing the index
+}
+
+// Waits out the background job without using its results
+void editor_grams_bg_drop() {
+    if (E.gramjob == NULL) return;
+    pool_group_wait(&E.gramjob->built);
+    editor_grams_bg_free(E.gramjob);
+}
+
+// Takes every leaf's filter away again
+void editor_grams_free() {
+    int start;
+    struct rope_node* leaf = E.numrows ? rope_leaf(&E.rows, 0, &start) : NULL;
+    for (; leaf; leaf = leaf->next) {
+        free(leaf->grams);
+        leaf->grams = NULL;
+    }
+    E.indexed = 0;
+}
+
+/* Switches the search index on or off, for this file and those opened after
+   it. It starts off, since its filters take memory, about an eighth of the
+   size of the text they cover. */
+void editor_grams_switch() {
+    E.find.index = !E.find.index;
+    if (E.find.index) {
+        editor_grams_bg_start();
+    } else {
+        editor_grams_bg_drop();
+        editor_grams_free();
+    }
+}
+
+/* Adds the trigrams around characters [from, to) of row at, which were just
+   put there or brought together, to the filter of its leaf. Those of text
+   taken out are left in, a filter only ever holds too many. */
+void editor_grams_note(int at, int from, int to) {
+    if (!E.indexed) return;
+    int start;
+    struct rope_node* leaf = rope_leaf(&E.rows, at, &start);
+    if (leaf->grams == NULL) return;
+
+    erow* row = &leaf->rows[at - start];
+    from = from > 2 ? from - 2 : 0;
+    to = to + 2 < row->size ? to + 2 : row->size;
+    if (to > from) {
+        gram_add(leaf->grams, editor_row_text(row, from, to), to - from);
+    }
+    leaf->grams = editor_grams_useful(leaf->grams);
+}
+
+/* UNDO */
+
+// Records a key typed or deleted, as part of the last such edit if it carries
+// straight on from it
+void editor_undo_key(int kind, int row, int cx, const char* c) {
+    if (undo_join(&E.undo, kind, row, cx, c, 1)) return;
+    undo_step(&E.undo);
+    undo_add(&E.undo, kind, row, cx, c, 1);
+    undo_keys(&E.undo);
+}
+
+// Makes the edit r records again, or takes it back if undo is set, and moves
+// the cursor to where it was made
+void editor_undo_apply(struct undo_rec* r, int undo) {
+    switch (r->kind) {
+        case UNDO_INSERT:
+        case UNDO_DELETE:
+            if ((r->kind == UNDO_INSERT) != undo) {
+                editor_row_insert_string(editor_row(r->row), r->cx, r->text,
+                                         r->len);
+                editor_grams_note(r->row, r->cx, r->cx + r->len);
+                E.cx = r->cx + r->len;
+            } else {
+                editor_row_delete_string(editor_row(r->row), r->cx, r->len);
+                editor_grams_note(r->row, r->cx, r->cx);
+                E.cx = r->cx;
+            }
+            E.cy = r->row;
+            editor_update_syntax_from(r->row);
+            break;
+
+        case UNDO_SPLIT:
+        case UNDO_JOIN:
+            if ((r->kind == UNDO_SPLIT) != undo) {
+                editor_split_row(r->row, r->cx);
+                E.cy = r->row + 1;
+                E.cx = 0;
+            } else {
+                editor_join_row(r->row);
+                E.cy = r->row;
+                E.cx = r->cx;
+            }
+            break;
+
+        case UNDO_ADD_ROW:
+            if (undo) {
+                editor_del_row(r->row);
+            } else {
+                editor_insert_row(r->row, r->text, r->len);
+            }
+            E.cy = r->row;
+            E.cx = 0;
+            break;
+    }
+}
+
+void editor_undo() {
+    struct undo_rec* r = undo_back(&E.undo);
+    if (r == NULL) {
+        editor_set_status("Nothing to undo");
+        return;
+    }
+    for (; r; r = undo_back(&E.undo)) {
+        editor_undo_apply(r, 1);
+        if (r->step) break;
+    }
+}
+
+void editor_redo() {
+    struct undo_rec* r = undo_forward(&E.undo, 0);
+    if (r == NULL) {
+        editor_set_status("Nothing to redo");
+        return;
+    }
+    for (; r; r = undo_forward(&E.undo, 1)) editor_undo_apply(r, 0);
+}
+
+/* EDITOR OPERATIONS */
+
+void editor_insert_char(int c) {
+    char ch = c;
+    if (E.cy == E.numrows) {  // At EOF, the row added is undone with the key
+        undo_step(&E.undo);
+        undo_add(&E.undo, UNDO_ADD_ROW, E.numrows, 0, NULL, 0);
+        undo_add(&E.undo, UNDO_INSERT, E.cy, E.cx, &ch, 1);
+        undo_keys(&E.undo);
+        editor_insert_row(E.numrows, "", 0);
+    } else {
+        editor_undo_key(UNDO_INSERT, E.cy, E.cx, &ch);
+    }
+    editor_row_insert_char(editor_row(E.cy), E.cx, c);
+    editor_grams_note(E.cy, E.cx, E.cx + 1);
+    editor_update_syntax_from(E.cy);
+    E.cx++;
+}
+
+void editor_insert_new_line() {
+    undo_step(&E.undo);
+    undo_add(&E.undo, E.cx ? UNDO_SPLIT : UNDO_ADD_ROW, E.cy, E.cx, NULL, 0);
+    editor_split_row(E.cy, E.cx);
+    E.cy++;
+    E.cx = 0;
+}
+
+/* Inserts text at the cursor as one edit. The row under the cursor is split
+   once, the lines in between become rows directly and highlighting is redone
+   from the first of them in a single pass. CR, LF and CRLF all end lines.
+   For undo it is the first line typed in, the row split after it, each line
+   after that added as a row and the rest of the split row joined to the
+   last. */
+void editor_insert_text(char* s, int len) {
+    if (len == 0) return;
+    undo_step(&E.undo);
+    if (E.cy == E.numrows) {
+        undo_add(&E.undo, UNDO_ADD_ROW, E.numrows, 0, NULL, 0);
+        editor_new_row(E.numrows, "", 0);
+    }
+
+    // The rest of the row moves to the end of the last inserted line
+    int first = E.cy;
+    erow* row = editor_row(E.cy);
+    int taillen = row->size - E.cx;
+    char* tail = malloc(taillen ? taillen : 1);
+    memcpy(tail, &editor_row_close_gap(row)[E.cx], taillen);
+
+    int i = 0;
+    while (i < len) {
+        int end = i;
+        while (end < len && s[end] != '\r' && s[end] != '\n') end++;
+
+        if (E.cy == first) {
+            if (!row->shared) row->gaplen += taillen;  // the tail joins the gap
+            editor_row_changed(row, E.cx, -taillen);
+            row->gap = row->size = E.cx;
+            editor_row_append_string(row, &s[i], end - i);
+            editor_grams_note(E.cy, E.cx, E.cx + end - i);
+            if (end > i) {
+                undo_add(&E.undo, UNDO_INSERT, E.cy, E.cx, &s[i], end - i);
+            }
+        } else {
+            editor_new_row(E.cy, &s[i], end - i);
+            undo_add(&E.undo, UNDO_ADD_ROW, E.cy, 0, &s[i], end - i);
+        }
+        E.cx += end - i;
+        if (end == len) break;
+
+        if (E.cy == first) undo_add(&E.undo, UNDO_SPLIT, E.cy, E.cx, NULL, 0);
+        i = end + ((s[end] == '\r' && end + 1 < len && s[end + 1] == '\n')
+                       ? 2
+                       : 1);
+        E.cy++;
+        E.cx = 0;
+        if (i == len) {
+            editor_new_row(E.cy, "", 0);
+            undo_add(&E.undo, UNDO_ADD_ROW, E.cy, 0, NULL, 0);
+        }
+    }
+
+    if (E.cy != first) undo_add(&E.undo, UNDO_JOIN, E.cy, E.cx, NULL, 0);
+    editor_row_append_string(editor_row(E.cy), tail, taillen);
+    editor_grams_note(E.cy, E.cx, E.cx);
+    free(tail);
+    editor_update_syntax_from(first);
+}
+
+/* Reads a bracketed paste up to its end marker and returns it, or NULL if
+   there was no memory for it, setting *len to its length. A paste whose end
+   marker never comes ends once no input has come for HAYAI_PASTE_MS. */
+char* editor_read_paste(int* len) {
+    static const char end[] = "\x1b[201~";
+    int cap = 4096;
+    int matched = 0;  // bytes of the end marker just read
+    char* buf = malloc(cap);
+    *len = 0;
+
+    char c;
+    while (matched < 6) {
+        if (E.inputpos == E.inputlen &&
+            !editor_wait(editor_clock_ms() + HAYAI_PASTE_MS)) {
+            break;
+        }
+        if (!editor_read_byte(&c, 0)) continue;
+        matched = c == end[matched] ? matched + 1 : c == end[0];
+
+        // Out of memory the rest is still read, to find where it ends
+        if (buf && *len == cap) {
+            char* grown = realloc(buf, cap *= 2);
+            if (grown == NULL) free(buf);
+            buf = grown;
+        }
+        if (buf) buf[(*len)++] = c;
+    }
+    if (matched == 6) *len -= 6;
+    return buf;
+}
+
+// Inserts a bracketed paste at the cursor
+void editor_paste() {
+    int len;
+    char* buf = editor_read_paste(&len);
+    if (buf == NULL) {
+        editor_set_status("Not enough memory to paste");
+        return;
+    }
+    editor_insert_text(buf, len);
+    free(buf);
+}
+
+void editor_del_char() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    erow* row = editor_row(E.cy);
+    if (E.cx > 0) {
+        editor_undo_key(UNDO_DELETE, E.cy, E.cx - 1,
+                        editor_row_text(row, E.cx - 1, E.cx));
+        editor_row_delete_char(row, E.cx - 1);
+        editor_grams_note(E.cy, E.cx - 1, E.cx - 1);
+        editor_update_syntax_from(E.cy);
+        E.cx--;
+    } else {
+        E.cx = rope_get(&E.rows, E.cy - 1)->size;
+        undo_step(&E.undo);
+        undo_add(&E.undo, UNDO_JOIN, E.cy - 1, E.cx, NULL, 0);
+        editor_join_row(E.cy - 1);
+        E.cy--;
+    }
+}
+
+/* FILE I/O */
+
+char* editor_row_to_string(int* buflen) {
+    int total_len = 0;
+    for (int i = 0; i < E.numrows; i++) {
+        total_len += rope_get(&E.rows, i)->size + 1;  //+1 for nl character
+    }
+    *buflen = total_len;
+
+    char* buf = malloc(total_len);  // function caller will free memory
+    char* p = buf;
+    for (int i = 0; i < E.numrows; i++) {
+        erow* row = rope_get(&E.rows, i);
+        editor_row_copy(row, 0, row->size, p);
+        p += row->size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+/* Builds the row index over E.filebuf. Rows keep pointing into it until they
+   are edited, render and highlighting are created on first use. */
+void editor_index_rows() {
+    char* buf = E.filebuf;
+    char* end = buf + E.filebuf_len;
+
+    for (char* p = buf; p < end; E.numrows++) {
+        char* nl = memchr(p, '\n', end - p);
+        char* eol = nl ? nl : end;
+        while (eol > p && eol[-1] == '\r') eol--;
+
+        erow* row = rope_insert(&E.rows, E.numrows);
+        row->size = eol - p;
+        row->rsize = 0;
+        row->chars = p;
+        row->render = NULL;
+        row->gap = row->size;
+        row->gaplen = 0;
+        row->shared = 1;
+        row->stale = 1;
+        row->id = 0;
+        row->rslot = -1;
+        row->hl_open = -1;
+        p = nl ? nl + 1 : end;
+    }
+}
+
+// Points shared rows at buf (as produced by editor_row_to_string) and releases
+// the old file buffer. Returns 1 if buf was kept as the new file buffer.
+int editor_rehome_rows(char* buf) {
+    if (E.filebuf == NULL) return 0;
+
+    int kept = 0;
+    char* p = buf;
+    for (int i = 0; i < E.numrows; i++) {
+        erow* row = rope_get(&E.rows, i);
+        if (row->shared) {
+            row->chars = p;
+            row->stale = 1;  // render may be sharing the old chars
+            kept = 1;
+        }
+        p += row->size + 1;
+    }
+
+    editor_syntax_bg_drop();  // the pool may be reading filebuf
+    int indexing = E.gramjob != NULL;
+    editor_grams_bg_drop();
+    if (E.filebuf_mapped) {
+        munmap(E.filebuf, E.filebuf_len);
+    } else {
+        free(E.filebuf);
+    }
+    E.filebuf = kept ? buf : NULL;
+    E.filebuf_len = kept ? (size_t)(p - buf) : 0;
+    E.filebuf_mapped = 0;
+    editor_syntax_bg_start();
+    if (indexing) editor_grams_bg_start();  // over again from buf
+    return kept;
+}
+
+// Drops every row of the current buffer, their text goes all at once
+void editor_close_buffer() {
+    editor_syntax_bg_drop();  // the pool may be reading filebuf
+    editor_grams_bg_drop();
+    rope_free(&E.rows);
+    E.indexed = 0;
+    undo_free(&E.undo);
+    arena_free(&E.text);
+    for (int i = 0; i < E.rcache_len; i++) {
+        E.rcache[i].owner = 0;
+    }
+
+    if (E.filebuf_mapped) {
+        munmap(E.filebuf, E.filebuf_len);
+    } else {
+        free(E.filebuf);
+    }
+    E.filebuf = NULL;
+    E.filebuf_len = 0;
+    E.filebuf_mapped = 0;
+
+    E.numrows = 0;
+    E.hl_known = 0;
+    E.cx = E.cy = E.rx = 0;
+    E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+}
+
+void editor_open(char* fname) {
+    editor_close_buffer();
+
+    free(E.filename);
+    E.filename = strdup(fname);
+
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        die("open");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        die("fstat");
+    }
+
+    if (st.st_size > 0) {  // mmap refuses empty mappings
+        E.filebuf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (E.filebuf == MAP_FAILED) {
+            die("mmap");
+        }
+        E.filebuf_len = st.st_size;
+        E.filebuf_mapped = 1;
+        editor_index_rows();
+        if (E.find.index) editor_grams_bg_start();
+    }
+    close(fd);
+    E.dirty = 0;
+
+    editor_select_syntax_highlight();
+}
+
+void editor_save() {
+    if (E.filename == NULL) {
+        E.filename = editor_prompt("Save As : %s [ESC to Cancel]", NULL, 0);
+        if (E.filename == NULL) {
+            editor_set_status("Save Aborted");
+            return;
+        }
+        editor_select_syntax_highlight();
+    }
+
+    int len;
+    char* out = editor_row_to_string(&len);
+
+    // The file is about to be truncated, shared rows must stop pointing into it
+    char* buf = editor_rehome_rows(out) ? NULL : out;  // NULL if kept
+
+    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
     if (fd != -1) {
         if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
+            if (write(fd, out, len) == len) {
                 close(fd);
                 free(buf);
                 E.dirty = 0;
@@ -606,56 +2117,488 @@ void editor_save() {
 }
 
 /* SEARCHING */
-void editor_find_callback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
 
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
+void editor_find_push(struct find_set* set, int row, int cx, int len) {
+    if (set->n == set->cap) {
+        set->cap = set->cap ? set->cap * 2 : 64;
+        set->m = realloc(set->m, sizeof(struct find_match) * set->cap);
+    }
+    set->m[set->n++] = (struct find_match){row, cx, len};
+}
+
+int editor_find_cancelled(struct find_job* job) {
+    pthread_mutex_lock(&job->lock);
+    int cancelled = job->cancelled;
+    pthread_mutex_unlock(&job->lock);
+    return cancelled;
+}
+
+// Where rx_find_all puts the matches of one row
+struct find_row {
+    struct find_set* set;
+    int row;
+};
+
+void editor_find_found(void* arg, int at, int len) {
+    struct find_row* r = arg;
+    editor_find_push(r->set, r->row, at, len);
+}
+
+/* Finds every match of query, or of re if given, in nrows rows from the
+   index'th row of leaf, numbering them from 0 there. Rows are read straight
+   from the rope leaves, so this can run on a worker while the rows are not
+   changing, and leaves whose trigram filter rules the query out are passed
+   over. It gives up early once job, if given, is cancelled. */
+void editor_find_rows(struct find_set* set, struct rope_node* leaf, int index,
+                      int nrows, const char* query, int len, int fold,
+                      const struct rx* re, struct find_job* job) {
+    char* buf = NULL;
+    int cap = 0;
+    struct rx_dfa* dfa = re ? rx_dfa_new(re) : NULL;
+    int filtered = !re && len >= 3;
+    for (int i = 0; i < nrows;) {
+        if (index == leaf->count) {
+            leaf = leaf->next;
+            index = 0;
+            if (job && editor_find_cancelled(job)) break;
+        }
+        if (filtered && leaf->grams && (index == 0 || i == 0) &&
+            !gram_may_hold(leaf->grams, query, len)) {
+            i += leaf->count - index;
+            index = leaf->count;
+            continue;
+        }
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+        erow* row = &leaf->rows[index];
+        const char* text = row->chars;
+        const char* end = text + row->size;
+        int run = 1;  // rows in text
+        if (row->shared && !re) {
+            // Rows that follow on in the file buffer are searched along with
+            // it, queries never hold the line breaks in between
+            while (i + run < nrows && index + run < leaf->count) {
+                erow* next = &leaf->rows[index + run];
+                if (!next->shared || next->chars < end ||
+                    next->chars - end > 2) {
+                    break;
+                }
+                end = next->chars + next->size;
+                run++;
+            }
+        } else if (row->gap == 0) {
+            text += row->gaplen;
+            end += row->gaplen;
+        } else if (row->gap < row->size) {  // the gap splits the row
+            if (row->size > cap) {
+                cap = row->size;
+                buf = realloc(buf, cap);
+            }
+            editor_row_copy(row, 0, row->size, buf);
+            text = buf;
+            end = buf + row->size;
+        }
+
+        if (re) {  // patterns can hold ^ and $, so rows are matched alone
+            struct find_row found = {set, i};
+            rx_find_all(dfa, text, row->size, editor_find_found, &found);
+            i++;
+            index++;
+            continue;
+        }
+        int r = 0;  // row of text the last match was in
+        const char* rowtext = text;
+        const char* rowend = text + row->size;
+        for (const char* p = text;; p++) {
+            p += scan_find(p, end - p, query, len, fold);
+            if (p == end) break;
+            while (p >= rowend) {
+                erow* next = &leaf->rows[index + ++r];
+                rowtext = next->chars;
+                rowend = rowtext + next->size;
+            }
+            editor_find_push(set, i + r, p - rowtext, len);
+        }
+        i += run;
+        index += run;
     }
+    free(buf);
+    rx_dfa_free(dfa);
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+/* Finds every match of query in the file buffer text [s, end), which starts
+   a row, numbering rows from 0 there. Returns the number of line breaks in
+   it. Rows are the lines of the buffer until the file is edited, less any
+   \r before the \n, which a query never holds. */
+int editor_find_text(struct find_set* set, const char* s, const char* end,
+                     const char* query, int len, int fold) {
+    int row = 0;
+    const char* line = s;  // start of row
+    const char* p = s;     // line breaks before p are counted
+    for (const char* m = s;; m++) {
+        m += scan_find(m, end - m, query, len, fold);
+        if (m == end) break;
+        const char* nl = memrchr(p, '\n', m - p);
+        if (nl) {
+            row += scan_count(p, nl + 1 - p, '\n');
+            line = nl + 1;
+        }
+        p = m;
+        editor_find_push(set, row, m - line, len);
+    }
+    return row + scan_count(p, end - p, '\n');
+}
+
+void editor_find_chunk_search(struct find_chunk* c) {
+    struct find_job* job = c->job;
+    if (c->start) {
+        c->nrows = editor_find_text(&c->found, c->start, c->end, job->query,
+                                    job->len, job->fold);
+    } else {
+        editor_find_rows(&c->found, c->leaf, c->index, c->nrows, job->query,
+                         job->len, job->fold, job->re, job);
+    }
+}
+
+void editor_find_bg_free(struct find_job* job) {
+    for (int k = 0; k < job->nchunks; k++) free(job->chunks[k].found.m);
+    free(job->chunks);
+    free(job->query);
+    pthread_cond_destroy(&job->finished);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+// Searches chunk c on the pool, unless it was cancelled or taken already
+void editor_find_chunk(void* arg) {
+    struct find_chunk* c = arg;
+    struct find_job* job = c->job;
+    pthread_mutex_lock(&job->lock);
+    int go = !c->started && !job->cancelled;
+    c->started = 1;
+    job->running += go;
+    pthread_mutex_unlock(&job->lock);
+
+    if (go) editor_find_chunk_search(c);
+
+    pthread_mutex_lock(&job->lock);
+    if (go) {
+        job->running--;
+        c->done = 1;
+    }
+    int last = --job->tasks == 0 && job->cancelled;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+
+    if (last) {
+        editor_find_bg_free(job);
+    } else if (go) {
+        write(E.wake[1], "", 1);  // editor_wait takes the matches in
+    }
+}
+
+// Keeps the matches of from that are followed by byte c at offset off
+void editor_find_narrow(struct find_set* set, struct find_set* from, int off,
+                        char c) {
+    int fold = E.find.fold;
+    if (fold) c = tolower((unsigned char)c);
+    erow* row = NULL;
+    int at = -1;
+    for (int k = 0; k < from->n; k++) {
+        struct find_match* m = &from->m[k];
+        if (m->row != at) {
+            at = m->row;
+            row = editor_row(at);
+        }
+        int i = m->cx + off;
+        if (i >= row->size) continue;
+        char b = row->chars[i < row->gap ? i : i + row->gaplen];
+        if ((fold ? tolower((unsigned char)b) : b) == c) {
+            editor_find_push(set, m->row, m->cx, off + 1);
+        }
+    }
+}
+
+/* Lets go of the background search once the chunks being searched are done
+   with the rows. It is freed here if its tasks have all returned, otherwise
+   by the last of them. */
+void editor_find_bg_release(struct find_job* job) {
+    pthread_mutex_lock(&job->lock);
+    job->cancelled = 1;
+    while (job->running) pthread_cond_wait(&job->finished, &job->lock);
+    int gone = job->tasks == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (gone) editor_find_bg_free(job);
+}
+
+// Cancels the background search, waiting only for the chunks it is running
+void editor_find_bg_drop() {
+    if (E.findjob == NULL) return;
+    editor_find_bg_release(E.findjob);
+    E.findjob = NULL;
+}
+
+/* Finishes the background search, searching the chunks no task has started
+   yet on this thread rather than waiting for the pool to come to them. */
+void editor_find_bg_wait() {
+    struct find_job* job = E.findjob;
+    if (job == NULL) return;
+
+    for (int k = 0; k < job->nchunks; k++) {
+        struct find_chunk* c = &job->chunks[k];
+        pthread_mutex_lock(&job->lock);
+        int go = !c->started;
+        c->started = 1;
+        pthread_mutex_unlock(&job->lock);
+        if (!go) continue;
+
+        editor_find_chunk_search(c);
+        pthread_mutex_lock(&job->lock);
+        c->done = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (job->running) pthread_cond_wait(&job->finished, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    editor_find_bg_collect();
+}
+
+/* Searches the whole file for the first level + 1 bytes of the query, into
+   E.find.sets[level], or for the pattern E.find.re. Until the first edit the
+   rows are the lines of the file buffer, which is searched for a query as it
+   is, otherwise the rows are. So are those of a file with a search index
+   once the query is long enough to have trigrams. Files of more
+   than HAYAI_FIND_CHUNK bytes or HAYAI_FIND_ROWS rows, and patterns, are
+   searched in chunks on the worker pool, so the next key can cancel them,
+   and the set fills in as editor_wait collects them. */
+void editor_find_start(int level) {
+    struct find_set* set = &E.find.sets[level];
+    set->n = 0;
+    set->known = 0;
+
+    char* p = E.filebuf;
+    char* end = p + E.filebuf_len;
+    int buffered = p && !E.dirty && !E.find.re && !(E.indexed && level >= 2);
+    int start;
+    if (buffered && end - p <= HAYAI_FIND_CHUNK) {
+        editor_find_text(set, p, end, E.find.query, level + 1, E.find.fold);
+        set->known = 1;
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+    }
+    if (E.numrows == 0 || (!buffered && !E.find.re &&
+                           E.numrows <= HAYAI_FIND_ROWS)) {
+        if (E.numrows > 0) {
+            editor_find_rows(set, rope_leaf(&E.rows, 0, &start), 0,
+                             E.numrows, E.find.query, level + 1, E.find.fold,
+                             NULL, NULL);
+        }
+        set->known = 1;
+        return;
+    }
+
+    struct find_job* job = calloc(1, sizeof(struct find_job));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    job->len = level + 1;
+    job->fold = E.find.fold;
+    job->re = E.find.re;
+    job->query = malloc(job->len);
+    memcpy(job->query, E.find.query, job->len);
+    job->level = level;
+    if (buffered) {
+        // Where the rows of each chunk start is known once the ones before
+        // it have counted their line breaks
+        job->nchunks = (end - p + HAYAI_FIND_CHUNK - 1) / HAYAI_FIND_CHUNK;
+        job->chunks = calloc(job->nchunks, sizeof(struct find_chunk));
+        job->nchunks = 0;
+        while (p < end) {
+            struct find_chunk* c = &job->chunks[job->nchunks++];
+            c->job = job;
+            c->start = p;
+            c->end = p = editor_chunk_end(p, end, HAYAI_FIND_CHUNK);
+        }
     } else {
-        last_match = -1;
-        direction = 1;
+        job->nchunks = (E.numrows + HAYAI_FIND_ROWS - 1) / HAYAI_FIND_ROWS;
+        job->chunks = calloc(job->nchunks, sizeof(struct find_chunk));
+        for (int k = 0; k < job->nchunks; k++) {
+            struct find_chunk* c = &job->chunks[k];
+            c->job = job;
+            c->first = k * HAYAI_FIND_ROWS;
+            c->nrows = E.numrows - c->first;
+            if (c->nrows > HAYAI_FIND_ROWS) c->nrows = HAYAI_FIND_ROWS;
+            c->leaf = rope_leaf(&E.rows, c->first, &start);
+            c->index = c->first - start;
+        }
     }
+    job->tasks = job->nchunks;
+    for (int k = 0; k < job->nchunks; k++) {
+        pool_submit(editor_pool(), editor_find_chunk, &job->chunks[k]);
+    }
+    E.findjob = job;
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    for (int i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1)
-            current = E.numrows - 1;
-        else if (current == E.numrows)
-            current = 0;
-
-        erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editor_rx_to_cx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+// Moves the cursor to the current match, if it has been found yet
+void editor_find_show() {
+    struct find_set* set = &E.find.sets[E.find.shown];
+    if (E.find.current >= set->n) return;
+
+    struct find_match* m = &set->m[E.find.current];
+    E.cy = m->row;
+    E.cx = m->cx;
+    E.rowoff = E.numrows;
+}
+
+/* Adds the chunks that finished since the last call to the set being filled,
+   keeping file order, and redraws to show the matches and their count. */
+void editor_find_bg_collect() {
+    struct find_job* job = E.findjob;
+    if (job == NULL) return;
+
+    int taken = job->taken;
+    pthread_mutex_lock(&job->lock);
+    while (job->taken < job->nchunks && job->chunks[job->taken].done) {
+        job->taken++;
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (taken == job->taken) return;
+
+    struct find_set* set = &E.find.sets[job->level];
+    int had = set->n;
+    for (int k = taken; k < job->taken; k++) {
+        struct find_chunk* c = &job->chunks[k];
+        if (c->start && k > 0) c->first = c[-1].first + c[-1].nrows;
+        struct find_set* found = &c->found;
+        for (int i = 0; i < found->n; i++) {
+            struct find_match* m = &found->m[i];
+            editor_find_push(set, c->first + m->row, m->cx, m->len);
+        }
+        free(found->m);
+        found->m = NULL;
+    }
+    if (job->taken == job->nchunks) {
+        set->known = 1;
+        editor_find_bg_release(job);  // tasks for chunks taken here may be left
+        E.findjob = NULL;
+    }
+
+    if (had == 0 && set->n > 0) editor_find_show();  // the first match is in
+    editor_refresh_screen();
+}
+
+/* Returns the matches of query, in file order, or NULL if it is empty. Sets
+   of the prefix it shares with the last query are reused as they are, and
+   a longer query narrows down the longest of them. A set with none of those
+   to start from is searched for, in the background for big files. Patterns
+   do not narrow as they grow, so each new one is searched for. */
+struct find_set* editor_find_matches(const char* query) {
+    struct find_cache* f = &E.find;
+    int len = strlen(query);
+    int keep = 0;
+    while (keep < f->len && keep < len && f->query[keep] == query[keep]) {
+        keep++;
+    }
+    if (f->regex && (keep < len || len != f->len)) {
+        editor_find_bg_drop();  // it reads the old pattern
+        rx_free(f->re);
+        f->re = len ? rx_compile(query, len, f->fold, &f->error) : NULL;
+    }
+
+    if (len > f->cap) {
+        int old = f->cap;
+        f->cap = f->cap ? f->cap : 16;
+        while (f->cap < len) f->cap *= 2;
+        f->query = realloc(f->query, f->cap);
+        f->sets = realloc(f->sets, sizeof(struct find_set) * f->cap);
+        memset(&f->sets[old], 0, sizeof(struct find_set) * (f->cap - old));
+    }
+    for (int i = keep; i < f->len; i++) f->sets[i].known = 0;
+    if (len > keep) memcpy(&f->query[keep], &query[keep], len - keep);
+    f->len = len;
+    f->shown = len - 1;
+
+    // A search still running is only worth keeping for this very query
+    if (E.findjob && E.findjob->level != len - 1) editor_find_bg_drop();
+    if (len == 0) return NULL;
+
+    struct find_set* set = &f->sets[len - 1];
+    if (set->known || E.findjob) return set;
+    if (f->regex && f->re == NULL) return NULL;
+
+    int k = f->regex ? -1 : len - 2;
+    while (k >= 0 && !f->sets[k].known) k--;
+    if (k < 0) {
+        editor_find_start(len - 1);
+        return set;
+    }
+    for (int i = k + 1; i < len; i++) {
+        f->sets[i].n = 0;
+        editor_find_narrow(&f->sets[i], &f->sets[i - 1], i, query[i]);
+        f->sets[i].known = 1;
+    }
+    return set;
+}
+
+/* Index of the first match that ends after chars index cx of row, or is on a
+   later row. The matches of a set end in the same order they start. */
+int editor_find_reaching(struct find_set* set, int row, int cx) {
+    int lo = 0, hi = set->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct find_match* m = &set->m[mid];
+        if (m->row < row || (m->row == row && m->cx + m->len <= cx)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
+
+// Drops every match set kept, along with any search still running
+void editor_find_forget() {
+    editor_find_bg_drop();
+    rx_free(E.find.re);
+    E.find.re = NULL;
+    for (int i = 0; i < E.find.len; i++) E.find.sets[i].known = 0;
+    E.find.len = 0;
+}
+
+void editor_find_callback(char* query, int key) {
+    if (key == '\r' || key == '\x1b') {
+        editor_find_forget();  // rows may change before the next search
+        E.find.shown = -1;
+        return;
+    } else if (key == CTRL_KEY('t')) {
+        E.find.fold = !E.find.fold;
+        editor_find_forget();
+    } else if (key == CTRL_KEY('r')) {
+        E.find.regex = !E.find.regex;
+        editor_find_forget();
+    } else if (key == CTRL_KEY('g')) {
+        editor_find_forget();  // the search may be reading the filters
+        editor_grams_switch();
+    }
+
+    struct find_set* set = editor_find_matches(query);
+    if (set == NULL) return;
+
+    // Past either end of the matches found so far wraps once all are in
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        if (E.find.current + 1 < set->n) {
+            E.find.current++;
+        } else if (set->known) {
+            E.find.current = 0;
+        }
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        if (E.find.current > 0) {
+            E.find.current--;
+        } else if (set->known && set->n > 0) {
+            E.find.current = set->n - 1;
+        }
+    } else {
+        E.find.current = 0;
+    }
+    editor_find_show();
 }
 
 void editor_find() {
@@ -666,7 +2609,7 @@ void editor_find() {
 
     char* query =
         editor_prompt("Search %s [ESC to Cancel, ARROW_KEYS to Navigate]",
-                      editor_find_callback);
+                      editor_find_callback, 0);
     if (query) {
         free(query);
     } else {
@@ -677,12 +2620,151 @@ void editor_find() {
     };
 }
 
+/* REPLACING */
+
+// Same as editor_find_callback, but the matches are kept when the query is
+// accepted since they are about to be replaced
+void editor_replace_callback(char* query, int key) {
+    if (key != '\r') editor_find_callback(query, key);
+}
+
+/* Replaces match k of set, then drops it and those after it on its row that
+   it overlapped, and moves the rest of the row's along to the new text. */
+void editor_replace_one(struct find_set* set, int k, const char* with,
+                        int wlen) {
+    struct find_match m = set->m[k];
+    erow* row = editor_row(m.row);
+    undo_step(&E.undo);
+    undo_add(&E.undo, UNDO_DELETE, m.row, m.cx,
+             editor_row_text(row, m.cx, m.cx + m.len), m.len);
+    undo_add(&E.undo, UNDO_INSERT, m.row, m.cx, with, wlen);
+    editor_row_replace(row, &m, 1, with, wlen);
+    editor_grams_note(m.row, m.cx, m.cx + wlen);
+    editor_update_syntax_from(m.row);
+
+    int j = k + 1;
+    while (j < set->n && set->m[j].row == m.row &&
+           set->m[j].cx < m.cx + m.len) {
+        j++;
+    }
+    memmove(&set->m[k], &set->m[j], sizeof(struct find_match) * (set->n - j));
+    set->n -= j - k;
+    for (int i = k; i < set->n && set->m[i].row == m.row; i++) {
+        set->m[i].cx += wlen - m.len;
+    }
+}
+
+/* Replaces matches k onwards of set, each row rebuilt once for all of its
+   matches and lexed again after. A match overlapping the one before it is
+   left alone. It is all undone as one step. Returns how many were
+   replaced. */
+int editor_replace_all(struct find_set* set, int k, const char* with,
+                       int wlen) {
+    struct find_match* picked = malloc(sizeof(struct find_match) * set->n);
+    int count = 0;
+    undo_step(&E.undo);
+    while (k < set->n) {
+        int row = set->m[k].row;
+        int n = 0;
+        for (; k < set->n && set->m[k].row == row; k++) {
+            struct find_match* m = &set->m[k];
+            if (n && m->cx < picked[n - 1].cx + picked[n - 1].len) continue;
+            picked[n++] = *m;
+        }
+        // Each match is recorded where the ones before it moved it to
+        erow* r = editor_row(row);
+        int shift = 0;
+        for (int i = 0; i < n; i++) {
+            struct find_match* m = &picked[i];
+            undo_add(&E.undo, UNDO_DELETE, row, m->cx + shift,
+                     editor_row_text(r, m->cx, m->cx + m->len), m->len);
+            undo_add(&E.undo, UNDO_INSERT, row, m->cx + shift, with, wlen);
+            shift += wlen - m->len;
+        }
+        editor_row_replace(r, picked, n, with, wlen);
+        shift = 0;
+        for (int i = 0; i < n; i++) {
+            int cx = picked[i].cx + shift;
+            editor_grams_note(row, cx, cx + wlen);
+            shift += wlen - picked[i].len;
+        }
+        editor_update_syntax_from(row);
+        count += n;
+    }
+    free(picked);
+    return count;
+}
+
+/* Prompts for a query and what to put in place of its matches, then steps
+   through them from the one shown, asking about each. */
+void editor_replace() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    char* query = editor_prompt(
+        "Replace %s [ESC to Cancel, ARROW_KEYS to Navigate]",
+        editor_replace_callback, 0);
+    char* with = NULL;
+    if (query) {
+        with = editor_prompt("Replace with %s [ESC to Cancel]", NULL, 1);
+    }
+    if (with == NULL) {
+        editor_find_forget();
+        E.find.shown = -1;
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+        free(query);
+        return;
+    }
+
+    // Every match has to be in before the rows start changing under them
+    editor_find_bg_wait();
+    struct find_set* set = editor_find_matches(query);
+
+    int wlen = strlen(with);
+    int count = 0;
+    int k = E.find.current;
+    while (set && k < set->n) {
+        E.find.current = k;
+        editor_find_show();
+        editor_set_status("Replace? (Y)es (N)o (A)ll [ESC to Stop]");
+        editor_refresh_screen();
+
+        int c = editor_read_key();
+        if (c == 'y' || c == 'Y') {
+            editor_replace_one(set, k, with, wlen);
+            count++;
+        } else if (c == 'n' || c == 'N') {
+            k++;
+        } else if (c == 'a' || c == 'A') {
+            count += editor_replace_all(set, k, with, wlen);
+            break;
+        } else if (c == '\x1b') {
+            break;
+        } else if (c == PASTE_START) {
+            int len;
+            free(editor_read_paste(&len));  // not an answer, so dropped
+        }
+    }
+
+    editor_find_forget();  // the matches left are out of date
+    E.find.shown = -1;
+    editor_set_status(
+        E.undo.lost ? "Replaced %d, too many to undo" : "Replaced %d", count);
+    free(query);
+    free(with);
+}
+
 /* OUTPUT FUNCTIONS */
 
 void editor_scroll() {  // adjusts cursor if it moves out of window
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editor_cx_to_rx(&E.row[E.cy], E.cx);
+        E.rx = editor_cx_to_rx(editor_row_rendered(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {  // past top
@@ -699,83 +2781,112 @@ void editor_scroll() {  // adjusts cursor if it moves out of window
     }
 }
 
-void editor_draw_rows(struct abuf* ab) {
-    for (int i = 0; i < E.screenrows; i++) {
-        int filerow = i + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (i == E.screenrows / 3 && E.numrows == 0) {
-                char welcome[80];
-                int welcome_len =
-                    snprintf(welcome, sizeof(welcome),
-                             "Hayai Editor -- version %s", HAYAI_VERSION);
-                if (welcome_len > E.screencols) {
-                    welcome_len = E.screencols;
-                }
+// Index of the span covering rendered column rx
+int editor_hl_find(struct render_slot* slot, int rx) {
+    int lo = 0, hi = slot->nhl - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slot->hl[mid].start + slot->hl[mid].len <= rx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-                // Padding
-                int padding = (E.screencols - welcome_len) / 2;
-                if (padding !=
-                    0) {  // Add ~ at start of line if padding required
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) {
-                    ab_append(ab, " ", 1);  // pad
-                }
+// Puts len characters of one highlight class on a screen line from column x
+void editor_draw_span(struct cell* line, int x, char* c, int len, int hl) {
+    for (int i = 0; i < len; i++) {
+        if (iscntrl((unsigned char)c[i])) {
+            // Control characters are shown inverted, as @ to Z or ?
+            char sym = (c[i] <= 26) ? '@' + c[i] : '?';
+            line[x + i] = (struct cell){sym, hl | CELL_INVERSE};
+        } else {
+            line[x + i] = (struct cell){c[i], hl};
+        }
+    }
+}
 
-                ab_append(ab, welcome, welcome_len);
-            } else {
-                ab_append(ab, "~", 1);
+// Puts a string on a screen line from column x
+void editor_draw_text(struct cell* line, int x, const char* s, int len,
+                      int hl) {
+    for (int i = 0; i < len; i++) line[x + i] = (struct cell){s[i], hl};
+}
+
+// Draws screen row i into line, which starts out blank
+void editor_draw_row(struct cell* line, int i) {
+    int filerow = i + E.rowoff;
+    if (filerow >= E.numrows) {
+        if (i == E.screenrows / 3 && E.numrows == 0) {
+            char welcome[80];
+            int welcome_len = snprintf(welcome, sizeof(welcome),
+                                       "Hayai Editor -- version %s",
+                                       HAYAI_VERSION);
+            if (welcome_len > E.screencols) {
+                welcome_len = E.screencols;
             }
+
+            // Padding, with ~ at start of line if padding required
+            int padding = (E.screencols - welcome_len) / 2;
+            if (padding != 0) line[0].c = '~';
+            editor_draw_text(line, padding, welcome, welcome_len, HL_NORMAL);
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            int current_colour = -1;
-            for (int i = 0; i < len; i++) {
-                if (iscntrl(c[i])) {
-                    char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-                    ab_append(ab, "\x1b[7m", 4);
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3);
-                    if (current_colour != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm",
-                                            current_colour);
-                        ab_append(ab, buf, clen);
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (current_colour != -1) {
-                        ab_append(ab, "\x1b[39m", 5);
-                        current_colour = -1;
-                    }
-                    ab_append(ab, &c[i], 1);
-                } else {
-                    int colour = editor_syntax_to_colour(hl[i]);
-                    if (colour != current_colour) {
-                        current_colour = colour;
-                        char buf[16];
-                        int clen =
-                            snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-                        ab_append(ab, buf, clen);
-                    }
-                    ab_append(ab, &c[i], 1);
+            line[0].c = '~';
+        }
+    } else {
+        erow* row = editor_row_rendered(filerow);
+        int len = row->rsize - E.coloff;
+        if (len < 0) len = 0;
+        if (len > E.screencols) len = E.screencols;
+
+        // Search matches are drawn over the syntax colours, from the first
+        // one that could reach into view
+        struct find_set* found = NULL;
+        int k = 0;
+        int ms = 0, me = 0;  // render columns of match k - 1
+        if (E.find.shown >= 0 && len > 0) {
+            found = &E.find.sets[E.find.shown];
+            k = editor_find_reaching(found, filerow,
+                                     editor_rx_to_cx(row, E.coloff));
+        }
+
+        // Spans and render start at the window, render column slot->wrx
+        struct render_slot* slot = &E.rcache[row->rslot];
+        int s = editor_hl_find(slot, E.coloff - slot->wrx);
+        int end = E.coloff + len;
+        for (int pos = E.coloff; pos < end;) {
+            struct hl_span* span = &slot->hl[s];
+            int span_end = slot->wrx + span->start + span->len;
+            int stop = span_end;
+            int hl = span->hl;
+
+            while (found && me <= pos) {
+                if (k == found->n || found->m[k].row != filerow) {
+                    found = NULL;
+                    break;
                 }
+                ms = editor_cx_to_rx(row, found->m[k].cx);
+                me = editor_cx_to_rx(row, found->m[k].cx + found->m[k].len);
+                k++;
             }
-            ab_append(ab, "\x1b[39m", 5);
-        }
+            if (found && pos < ms) {
+                if (stop > ms) stop = ms;
+            } else if (found) {
+                hl = HL_MATCH;
+                if (stop > me) stop = me;
+            }
+            if (stop > end) stop = end;
 
-        ab_append(ab, "\x1b[K", 3);
-        ab_append(ab, "\r\n", 2);
+            editor_draw_span(line, pos - E.coloff,
+                             &row->render[pos - slot->wrx], stop - pos, hl);
+            pos = stop;
+            if (pos == span_end) s++;
+        }
     }
 }
 
-void editor_draw_statusbar(struct abuf* ab) {
-    ab_append(ab, "\x1b[7m", 4);  // invert colours
-
+void editor_draw_statusbar(struct cell* line) {
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
@@ -784,52 +2895,233 @@ void editor_draw_statusbar(struct abuf* ab) {
                         E.syntax ? E.syntax->filetype : "No Filetype", E.cy + 1,
                         E.numrows);
     if (len > E.screencols) len = E.screencols;
-    ab_append(ab, status, len);
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            ab_append(ab, rstatus, rlen);
-            break;
-        } else {
-            ab_append(ab, " ", 1);
-            len++;
-        }
+    // The whole bar is inverted, rstatus goes flush right if it fits
+    for (int x = 0; x < E.screencols; x++) {
+        line[x] = (struct cell){' ', HL_NORMAL | CELL_INVERSE};
+    }
+    editor_draw_text(line, 0, status, len, HL_NORMAL | CELL_INVERSE);
+    if (E.screencols - len >= rlen) {
+        editor_draw_text(line, E.screencols - rlen, rstatus, rlen,
+                         HL_NORMAL | CELL_INVERSE);
     }
-    ab_append(ab, "\x1b[m", 3);
-    ab_append(ab, "\r\n", 2);
 }
 
-void editor_draw_msgbar(struct abuf* ab) {
-    ab_append(ab, "\x1b[K", 3);
+void editor_draw_msgbar(struct cell* line) {
     int len = strlen(E.statusmsg);
     if (len > E.screencols) len = E.screencols;
     if (len && time(NULL) - E.statusmsg_time < 5) {
-        ab_append(ab, E.statusmsg, len);
+        editor_draw_text(line, 0, E.statusmsg, len, HL_NORMAL);
+    }
+
+    // While searching, which match the cursor is on goes flush right
+    if (E.find.shown >= 0) {
+        struct find_set* set = &E.find.sets[E.find.shown];
+        char index[32] = "";
+        if (E.gramjob) {
+            snprintf(index, sizeof(index), ", indexing");
+        } else if (E.indexed) {
+            snprintf(index, sizeof(index), ", index %d KB", E.indexed);
+        } else if (E.find.index) {
+            snprintf(index, sizeof(index), ", not indexed");
+        }
+        char mode[64];
+        snprintf(mode, sizeof(mode), "%s%s%s", E.find.regex ? ", pattern" : "",
+                 E.find.fold ? ", any case" : "", index);
+        char count[96];
+        int clen;
+        if (E.find.regex && E.find.re == NULL) {
+            clen = snprintf(count, sizeof(count), "%s%s", E.find.error, mode);
+        } else if (set->n) {
+            clen = snprintf(count, sizeof(count), "%d of %d%s%s",
+                            E.find.current + 1, set->n, set->known ? "" : "+",
+                            mode);
+        } else {
+            clen = snprintf(count, sizeof(count), "%s%s",
+                            set->known ? "no matches" : "searching", mode);
+        }
+        if (E.screencols - len > clen) {
+            editor_draw_text(line, E.screencols - clen, count, clen, HL_NORMAL);
+        }
     }
 }
 
-void editor_refresh_screen() {
-    editor_scroll();
+// Switches the terminal from drawing cells like *from to drawing them like to
+void editor_draw_attr(struct abuf* ab, int* from, int to) {
+    if ((*from & CELL_INVERSE) && !(to & CELL_INVERSE)) {
+        ab_append(ab, "\x1b[m", 3);
+        *from = HL_NORMAL;
+    }
+    int colour = editor_syntax_to_colour(to & ~CELL_INVERSE);
+    if (colour != editor_syntax_to_colour(*from & ~CELL_INVERSE)) {
+        ab_sgr(ab, colour == COL_WHITE ? 39 : colour);
+    }
+    if (!(*from & CELL_INVERSE) && (to & CELL_INVERSE)) {
+        ab_sgr(ab, 7);
+    }
+    *from = to;
+}
+
+/* Queues the part of screen line y that differs from the last frame, from the
+   first changed cell to the last. A blank tail is cleared rather than drawn.
+   Lines with multibyte characters are sent whole, as their cells do not line
+   up with the terminal's columns. */
+void editor_draw_line(struct abuf* ab, int y, int* attr) {
+    struct cell* old = &E.frame[y * E.screencols];
+    struct cell* new = &E.next[y * E.screencols];
+    int cols = E.screencols;
+
+    int first = 0, last = cols - 1;
+    int ascii = 1;
+    for (int x = 0; x < cols; x++) {
+        ascii &= !((old[x].c | new[x].c) & 0x80);
+    }
+    if (E.frame_valid && ascii) {
+        while (first < cols && old[first].c == new[first].c &&
+               old[first].hl == new[first].hl) {
+            first++;
+        }
+        if (first == cols) return;
+        while (old[last].c == new[last].c && old[last].hl == new[last].hl) {
+            last--;
+        }
+    } else if (E.frame_valid &&
+               !memcmp(old, new, sizeof(struct cell) * cols)) {
+        return;
+    }
+
+    int end = cols;  // new is blank from end onwards
+    while (end > first && new[end - 1].c == ' ' &&
+           new[end - 1].hl == HL_NORMAL) {
+        end--;
+    }
 
-    struct abuf ab = ABUF_INIT;
+    if (ab->len == 0) {
+        ab_append(ab, "\x1b[?25l", 6);  // hide cursor before refreshing screen
+    }
 
-    ab_append(&ab, "\x1b[?25l", 6);  // hide cursor before refreshing screen
-    ab_append(&ab, "\x1b[H", 3);
+    // A line starting right below the last one drawn is reached with CRLF
+    if (first == 0 && E.draw_y >= 0 && E.draw_y == y - 1) {
+        ab_append(ab, "\r\n", 2);
+    } else if (E.draw_y != y || E.draw_x != first) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+        ab_append(ab, buf, len);
+    }
 
-    editor_draw_rows(&ab);
-    editor_draw_statusbar(&ab);
-    editor_draw_msgbar(&ab);
+    int x = first;
+    for (; x <= last && x < end; x++) {
+        if (new[x].hl != *attr) editor_draw_attr(ab, attr, new[x].hl);
+        ab_putc(ab, new[x].c);
+    }
+    if (last >= end) {
+        if (*attr != HL_NORMAL) editor_draw_attr(ab, attr, HL_NORMAL);
+        ab_append(ab, "\x1b[K", 3);
+    }
+    E.draw_y = y;
+    E.draw_x = x;
+}
 
+/* Scrolls the text rows on the terminal and in frame by as many lines as the
+   view moved since the last frame, so that only the rows brought into view
+   differ. The status and message bars sit outside the scroll region. */
+void editor_scroll_frame(struct abuf* ab) {
+    int rows = E.screenrows, cols = E.screencols;
+    int d = E.rowoff - E.frame_rowoff;
+    int n = abs(d);
+    if (!E.frame_valid || d == 0 || n >= rows || rows < 2) return;
+    if (E.coloff != E.frame_coloff) return;  // shifted rows would not match
+
+    // Index at the bottom margin scrolls up, reverse index at the top down
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) +
-                 1);  // add one to convert to terminal's 1 index positions
-    ab_append(&ab, buf, strlen(buf));
+    int len = snprintf(buf, sizeof(buf), "\x1b[?25l\x1b[1;%dr\x1b[%d;1H", rows,
+                       d > 0 ? rows : 1);
+    ab_append(ab, buf, len);
+    for (int i = 0; i < n; i++) {
+        if (d > 0) {
+            ab_putc(ab, '\n');
+        } else {
+            ab_append(ab, "\x1bM", 2);
+        }
+    }
+    ab_append(ab, "\x1b[r", 3);  // also homes the cursor
+
+    struct cell* blank;
+    size_t keep = sizeof(struct cell) * (rows - n) * cols;
+    if (d > 0) {
+        memmove(E.frame, &E.frame[n * cols], keep);
+        blank = &E.frame[(rows - n) * cols];
+    } else {
+        memmove(&E.frame[n * cols], E.frame, keep);
+        blank = E.frame;
+    }
+    for (int i = 0; i < n * cols; i++) blank[i] = (struct cell){' ', HL_NORMAL};
+    E.draw_y = E.draw_x = 0;
+}
+
+void editor_refresh_screen() {
+    editor_syntax_bg_finish(0);
+    editor_scroll();
+
+    // Draw the frame into cells, text rows then the status and message bars
+    for (int y = 0; y < E.screenrows + 2; y++) {
+        struct cell* line = &E.next[y * E.screencols];
+        for (int x = 0; x < E.screencols; x++) {
+            line[x] = (struct cell){' ', HL_NORMAL};
+        }
+        if (y < E.screenrows) {
+            editor_draw_row(line, y);
+        } else if (y == E.screenrows) {
+            editor_draw_statusbar(line);
+        } else {
+            editor_draw_msgbar(line);
+        }
+    }
+
+    // Send only what changed since the last frame
+    struct abuf* ab = &E.out;
+    ab->len = 0;
+    int attr = HL_NORMAL;
+    E.draw_y = E.draw_x = -1;
+    editor_scroll_frame(ab);
+    for (int y = 0; y < E.screenrows + 2; y++) {
+        editor_draw_line(ab, y, &attr);
+    }
+    if (attr != HL_NORMAL) editor_draw_attr(ab, &attr, HL_NORMAL);
+
+    struct cell* swap = E.frame;
+    E.frame = E.next;
+    E.next = swap;
+    E.frame_valid = 1;
+    E.frame_rowoff = E.rowoff;
+    E.frame_coloff = E.coloff;
+
+    // add one to convert to terminal's 1 index positions
+    int cy = (E.cy - E.rowoff) + 1;
+    int cx = (E.rx - E.coloff) + 1;
+    int redrawn = ab->len > 0;
+    if (redrawn || cy != E.frame_cy || cx != E.frame_cx) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+        ab_append(ab, buf, len);
+        E.frame_cy = cy;
+        E.frame_cx = cx;
+    }
+    if (redrawn) {
+        ab_append(ab, "\x1b[?25h", 6);  // show cursor after refreshing screen
+    }
+
+    if (ab->len) write(STDOUT_FILENO, ab->b, ab->len);  // the whole frame at once
 
-    ab_append(&ab, "\x1b[?25h", 6);  // show cursor after refreshing screen
+    editor_prefetch_rows();
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    ab_free(&ab);
+/* Returns when on editor_clock_ms the status message on screen goes, or -1 if
+   there is none to take down. */
+long editor_status_expiry() {
+    time_t left = E.statusmsg_time + 5 - time(NULL);
+    if (E.statusmsg[0] == '\0' || left <= 0) return -1;
+    return editor_clock_ms() + left * 1000;
 }
 
 void editor_set_status(const char* fmt, ...) {
@@ -842,7 +3134,9 @@ void editor_set_status(const char* fmt, ...) {
 
 /* INPUT FUNCTIONS */
 
-char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
+// Returns what was typed, or NULL on escape. Empty input is only accepted if
+// empty is set.
+char* editor_prompt(char* prompt, void (*callback)(char*, int), int empty) {
     size_t bufsize = 128;
     char* buf = malloc(bufsize);
 
@@ -862,11 +3156,26 @@ char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || empty) {
                 editor_set_status("");
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE_START) {
+            // Pasted text goes in up to its first line break
+            int len;
+            char* paste = editor_read_paste(&len);
+            if (paste && buflen + len >= bufsize) {
+                while (buflen + len >= bufsize) bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            for (int i = 0; paste && i < len; i++) {
+                unsigned char ch = paste[i];
+                if (ch == '\r' || ch == '\n') break;
+                if (ch < 128 && !iscntrl(ch)) buf[buflen++] = ch;
+            }
+            buf[buflen] = '\0';
+            free(paste);
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -880,7 +3189,7 @@ char* editor_prompt(char* prompt, void (*callback)(char*, int)) {
 }
 
 void editor_move_cursor(int key) {
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : rope_get(&E.rows, E.cy);
 
     switch (key) {
         case ARROW_UP:
@@ -891,7 +3200,7 @@ void editor_move_cursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {  // move line back if cursor at start of line
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = rope_get(&E.rows, E.cy)->size;
             }
             break;
         case ARROW_DOWN:
@@ -907,7 +3216,7 @@ void editor_move_cursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : rope_get(&E.rows, E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {  // Cursor cannot be moved past right side when moving
                           // to new line
@@ -946,12 +3255,24 @@ void editor_process_key() {
             editor_find();
             break;
 
+        case CTRL_KEY('r'):
+            editor_replace();
+            break;
+
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+
         case HOME_KEY:
             E.cx = 0;
             break;
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = rope_get(&E.rows, E.cy)->size;
             }
             break;
 
@@ -984,8 +3305,13 @@ void editor_process_key() {
             editor_move_cursor(c);
             break;
 
+        case PASTE_START:
+            editor_paste();
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
+        case PASTE_END:
             // Disabled Escape sequences and Clear Screen sequence
             break;
 
@@ -998,6 +3324,26 @@ void editor_process_key() {
 }
 
 /* INIT */
+
+// Sizes the render cache and the frame buffers for the window
+void editor_size_screen() {
+    // Always room for a full window plus prefetched rows on both sides
+    int len = E.screenrows + 2 * HAYAI_PREFETCH_ROWS;
+    if (len < HAYAI_RENDER_CACHE) len = HAYAI_RENDER_CACHE;
+    if (len > E.rcache_len) {  // slots keep their index, rows point at them
+        E.rcache = realloc(E.rcache, sizeof(struct render_slot) * len);
+        memset(&E.rcache[E.rcache_len], 0,
+               sizeof(struct render_slot) * (len - E.rcache_len));
+        E.rcache_len = len;
+    }
+
+    free(E.frame);
+    free(E.next);
+    E.frame = calloc((E.screenrows + 2) * E.screencols, sizeof(struct cell));
+    E.next = calloc((E.screenrows + 2) * E.screencols, sizeof(struct cell));
+    E.frame_valid = 0;
+}
+
 void editor_init() {
     E.cx = 0;
     E.cy = 0;
@@ -1005,16 +3351,51 @@ void editor_init() {
     E.numrows = 0;
     E.rowoff = 0;
     E.coloff = 0;
-    E.row = NULL;
+    E.rows = (struct rope)ROPE_INIT;
+    E.text = (struct arena)ARENA_INIT;
+    E.undo = (struct undo_log)UNDO_INIT(HAYAI_UNDO_BUDGET);
+    E.filebuf = NULL;
+    E.filebuf_len = 0;
+    E.filebuf_mapped = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.find.shown = -1;
+
+    // The wake pipe never blocks, a full pipe already means wake up
+    if (pipe(E.wake) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(E.wake[i], F_SETFL, fcntl(E.wake[i], F_GETFL) | O_NONBLOCK);
+    }
+    signal(SIGWINCH, editor_handle_winch);
+
     if (get_window_size(&E.screenrows, &E.screencols) == -1) {
         die("get_window_size");
     }
     E.screenrows -= 2;  // space for status bar
+
+    E.rcache = NULL;
+    E.rcache_len = 0;
+    E.rowids = 0;
+    E.rhand = 0;
+    E.frame = E.next = NULL;
+    editor_size_screen();
+    E.out = (struct abuf)ABUF_INIT;
+}
+
+// Picks up a new window size, the whole screen is drawn again
+void editor_resize() {
+    int rows, cols;
+    if (get_window_size(&rows, &cols) == -1) return;
+    rows -= 2;
+    if (rows == E.screenrows && cols == E.screencols) return;
+
+    E.screenrows = rows;
+    E.screencols = cols;
+    editor_size_screen();
+    editor_refresh_screen();
 }
 
 /* MAIN */
@@ -1026,11 +3407,29 @@ int main(int argc, char** argv) {
         editor_open(argv[1]);
     }
 
-    editor_set_status("Ctrl-Q to Quit | Ctrl-S to Save | Ctrl-F to Find");
+    editor_set_status(
+        "Ctrl-Q to Quit | Ctrl-S to Save | Ctrl-F to Find | Ctrl-R to Replace");
 
+    long drawn;  // when the screen was last drawn
     while (1) {  // Main Loop
         editor_refresh_screen();
-        editor_process_key();
+        drawn = editor_clock_ms();
+
+        // Idle until a key comes, redrawing when the status message runs out
+        while (!editor_wait(editor_status_expiry())) {
+            editor_refresh_screen();
+            drawn = editor_clock_ms();
+        }
+
+        /* Keys that are already waiting are all handled before drawing again,
+           so a paste or a held key costs one redraw per batch rather than one
+           per key. A key is drawn at once, unless the last frame was less than
+           HAYAI_FRAME_MS ago, then keys are gathered until the next is due. */
+        long due = drawn + HAYAI_FRAME_MS;
+        do {
+            editor_process_key();
+            editor_scroll();  // Page Up and Down move relative to the view
+        } while (editor_wait(due));
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "./keywords.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "./hayai_enums.h"
+
+static unsigned int kw_hash(unsigned int seed, const char* s, int len) {
+    unsigned int h = 2166136261u ^ seed;  // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Places every entry in t, returns 0 if two of them collide
+static int kw_place(struct kwtable* t, struct kw_entry* entries, int n) {
+    memset(t->slots, 0, sizeof(struct kw_entry) * (t->mask + 1));
+    for (int i = 0; i < n; i++) {
+        unsigned int h = kw_hash(t->seed, entries[i].word, entries[i].len);
+        struct kw_entry* slot = &t->slots[h & t->mask];
+        if (slot->word) return 0;
+        *slot = entries[i];
+    }
+    return 1;
+}
+
+/* Builds the table for a NULL terminated keyword list. Keywords ending in |
+   are literals and get HL_KW2, the rest HL_KW1. */
+struct kwtable* kw_compile(char** keywords) {
+    int n = 0;
+    while (keywords[n]) n++;
+
+    struct kw_entry* entries = malloc(sizeof(struct kw_entry) * (n ? n : 1));
+    struct kwtable* t = malloc(sizeof(struct kwtable));
+    t->minlen = n ? 1 << 30 : 0;
+    t->maxlen = 0;
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int len = strlen(keywords[i]);
+        int kw2 = keywords[i][len - 1] == '|';
+        if (kw2) len--;
+
+        // A repeated keyword would collide with itself under every seed
+        int j = 0;
+        while (j < count && (entries[j].len != len ||
+                             memcmp(entries[j].word, keywords[i], len))) {
+            j++;
+        }
+        if (j < count) continue;
+
+        entries[count].word = keywords[i];
+        entries[count].len = len;
+        entries[count].hl = kw2 ? HL_KW2 : HL_KW1;
+        count++;
+        if (len < t->minlen) t->minlen = len;
+        if (len > t->maxlen) t->maxlen = len;
+    }
+
+    // Search for a seed with no collisions, widening the table if none works
+    unsigned int size = 4;
+    while (size < (unsigned int)count * 2) size *= 2;
+    t->slots = NULL;
+    for (;; size *= 2) {
+        t->slots = realloc(t->slots, sizeof(struct kw_entry) * size);
+        t->mask = size - 1;
+        for (t->seed = 0; t->seed < 64; t->seed++) {
+            if (kw_place(t, entries, count)) {
+                free(entries);
+                return t;
+            }
+        }
+    }
+}
+
+// Returns the highlight class of s if it is a keyword, HL_NORMAL otherwise
+int kw_lookup(const struct kwtable* t, const char* s, int len) {
+    if (len < t->minlen || len > t->maxlen) return HL_NORMAL;
+
+    struct kw_entry* slot = &t->slots[kw_hash(t->seed, s, len) & t->mask];
+    if (slot->word && slot->len == len && !memcmp(slot->word, s, len)) {
+        return slot->hl;
+    }
+    return HL_NORMAL;
+}
@@ -0,0 +1,144 @@
+#include "./pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pool_task {
+    void (*fn)(void*);
+    void* arg;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // signalled when a task is queued
+    pthread_cond_t idle;  // signalled when the last task finishes
+    struct pool_task* queue;
+    int head, len, cap;  // ring buffer of queued tasks
+    int running;
+    int nthreads;
+    int notify;  // gets a byte whenever the pool goes idle, -1 if unset
+};
+
+static void* pool_worker(void* arg) {
+    struct pool* p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->len == 0) pthread_cond_wait(&p->work, &p->lock);
+
+        struct pool_task t = p->queue[p->head];
+        p->head = (p->head + 1) % p->cap;
+        p->len--;
+        p->running++;
+
+        pthread_mutex_unlock(&p->lock);
+        t.fn(t.arg);
+        pthread_mutex_lock(&p->lock);
+
+        p->running--;
+        if (p->len == 0 && p->running == 0) {
+            pthread_cond_broadcast(&p->idle);
+            if (p->notify >= 0) write(p->notify, "", 1);
+        }
+    }
+    return NULL;
+}
+
+/* Starts up to nthreads detached workers, they live as long as the process.
+   Tasks run on the caller's thread if none could be started. */
+struct pool* pool_new(int nthreads) {
+    struct pool* p = calloc(1, sizeof(struct pool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    p->notify = -1;
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, pool_worker, p) == 0) {
+            pthread_detach(t);
+            p->nthreads++;
+        }
+    }
+    return p;
+}
+
+void pool_notify(struct pool* p, int fd) {
+    pthread_mutex_lock(&p->lock);
+    p->notify = fd;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_submit(struct pool* p, void (*fn)(void*), void* arg) {
+    if (p->nthreads == 0) {  // no threads could be started
+        fn(arg);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (p->len == p->cap) {
+        // Unwrap the ring into a bigger buffer
+        int cap = p->cap ? p->cap * 2 : 16;
+        struct pool_task* queue = malloc(sizeof(struct pool_task) * cap);
+        for (int i = 0; i < p->len; i++) {
+            queue[i] = p->queue[(p->head + i) % p->cap];
+        }
+        free(p->queue);
+        p->queue = queue;
+        p->head = 0;
+        p->cap = cap;
+    }
+    p->queue[(p->head + p->len) % p->cap] = (struct pool_task){fn, arg};
+    p->len++;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pool_idle(struct pool* p) {
+    pthread_mutex_lock(&p->lock);
+    int idle = p->len == 0 && p->running == 0;
+    pthread_mutex_unlock(&p->lock);
+    return idle;
+}
+
+void pool_wait(struct pool* p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->len != 0 || p->running != 0) pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_group_init(struct pool_group* g, int tasks, int notify) {
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->done, NULL);
+    g->left = tasks;
+    g->notify = notify;
+}
+
+void pool_group_done(struct pool_group* g) {
+    pthread_mutex_lock(&g->lock);
+    int last = --g->left == 0;
+    if (last) pthread_cond_broadcast(&g->done);
+    int fd = g->notify;
+    pthread_mutex_unlock(&g->lock);
+    // g may be freed as soon as the lock is let go, so only fd is used
+    if (last && fd >= 0) write(fd, "", 1);
+}
+
+int pool_group_idle(struct pool_group* g) {
+    pthread_mutex_lock(&g->lock);
+    int idle = g->left == 0;
+    pthread_mutex_unlock(&g->lock);
+    return idle;
+}
+
+void pool_group_wait(struct pool_group* g) {
+    pthread_mutex_lock(&g->lock);
+    while (g->left != 0) pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
+
+void pool_group_free(struct pool_group* g) {
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->done);
+}
@@ -0,0 +1,250 @@
+#include "./rope.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "./gram.h"
+
+static struct rope_node* rope_node_new(int leaf) {
+    struct rope_node* n = malloc(sizeof(struct rope_node));
+    n->leaf = leaf;
+    n->count = 0;
+    n->total = 0;
+    n->prev = NULL;
+    n->next = NULL;
+    n->grams = NULL;
+    return n;
+}
+
+static void rope_node_free(struct rope_node* n) {
+    if (!n->leaf) {
+        for (int i = 0; i < n->count; i++) rope_node_free(n->child[i]);
+    }
+    free(n->grams);
+    free(n);
+}
+
+// Moves the rows from mid onwards into a new leaf linked after n
+static struct rope_node* rope_leaf_split(struct rope_node* n, int mid) {
+    struct rope_node* right = rope_node_new(1);
+    right->count = n->count - mid;
+    memcpy(right->rows, &n->rows[mid], sizeof(erow) * right->count);
+    n->count = mid;
+
+    // Both halves keep the whole filter, it still holds all of their rows
+    if (n->grams) right->grams = gram_copy(n->grams);
+
+    right->prev = n;
+    right->next = n->next;
+    if (n->next) n->next->prev = right;
+    n->next = right;
+
+    n->total = n->count;
+    right->total = right->count;
+    return right;
+}
+
+// Moves the upper half of n's children into a new inner node
+static struct rope_node* rope_inner_split(struct rope_node* n) {
+    struct rope_node* right = rope_node_new(0);
+    int mid = n->count / 2;
+    right->count = n->count - mid;
+    memcpy(right->child, &n->child[mid],
+           sizeof(struct rope_node*) * right->count);
+    n->count = mid;
+
+    for (int i = 0; i < right->count; i++) {
+        right->total += right->child[i]->total;
+    }
+    n->total -= right->total;
+    return right;
+}
+
+/* Opens a slot for a row at index at below n and stores it in *slot. If n had
+   to be split the new right sibling is returned, NULL otherwise. */
+static struct rope_node* rope_node_insert(struct rope_node* n, int at,
+                                          erow** slot) {
+    if (n->leaf) {
+        struct rope_node* right = NULL;
+        if (n->count == ROPE_LEAF_ROWS) {
+            // Appending to the last leaf starts a fresh one so that rows added
+            // in order (like when opening a file) leave leaves full
+            int mid = (at == n->count && n->next == NULL) ? n->count
+                                                          : n->count / 2;
+            right = rope_leaf_split(n, mid);
+            if (at >= mid) {
+                n = right;
+                at -= mid;
+            }
+        }
+        memmove(&n->rows[at + 1], &n->rows[at], sizeof(erow) * (n->count - at));
+        n->count++;
+        n->total++;
+        *slot = &n->rows[at];
+        return right;
+    }
+
+    int k = 0;
+    if (at == n->total) {  // appending, skip straight to the last child
+        k = n->count - 1;
+        at = n->child[k]->total;
+    }
+    while (k < n->count - 1 && at > n->child[k]->total) {
+        at -= n->child[k]->total;
+        k++;
+    }
+
+    n->total++;
+    struct rope_node* split = rope_node_insert(n->child[k], at, slot);
+    if (split == NULL) return NULL;
+
+    memmove(&n->child[k + 2], &n->child[k + 1],
+            sizeof(struct rope_node*) * (n->count - k - 1));
+    n->child[k + 1] = split;
+    n->count++;
+
+    return n->count > ROPE_FANOUT ? rope_inner_split(n) : NULL;
+}
+
+// Removes child k from inner node n, unlinking it if it is a leaf
+static void rope_remove_child(struct rope_node* n, int k) {
+    struct rope_node* c = n->child[k];
+    if (c->leaf) {
+        if (c->prev) c->prev->next = c->next;
+        if (c->next) c->next->prev = c->prev;
+    }
+    rope_node_free(c);
+    memmove(&n->child[k], &n->child[k + 1],
+            sizeof(struct rope_node*) * (n->count - k - 1));
+    n->count--;
+}
+
+static void rope_node_delete(struct rope_node* n, int at) {
+    n->total--;
+    if (n->leaf) {
+        memmove(&n->rows[at], &n->rows[at + 1],
+                sizeof(erow) * (n->count - at - 1));
+        n->count--;
+        return;
+    }
+
+    int k = 0;
+    while (at >= n->child[k]->total) {
+        at -= n->child[k]->total;
+        k++;
+    }
+
+    struct rope_node* c = n->child[k];
+    rope_node_delete(c, at);
+
+    if (c->count == 0) {
+        rope_remove_child(n, k);
+    } else if (c->leaf && c->count < ROPE_LEAF_ROWS / 4) {
+        // Fold a nearly empty leaf into a neighbour that has room for it
+        int left;
+        if (k + 1 < n->count &&
+            c->count + n->child[k + 1]->count <= ROPE_LEAF_ROWS) {
+            left = k;
+        } else if (k > 0 &&
+                   c->count + n->child[k - 1]->count <= ROPE_LEAF_ROWS) {
+            left = k - 1;
+        } else {
+            return;
+        }
+
+        struct rope_node* a = n->child[left];
+        struct rope_node* b = n->child[left + 1];
+        memcpy(&a->rows[a->count], b->rows, sizeof(erow) * b->count);
+        a->count += b->count;
+        a->total = a->count;
+        if (a->grams && b->grams) a->grams = gram_merge(a->grams, b->grams);
+        // Without both filters, or with one too full, a's rows go unfiltered
+        if (a->grams && (b->grams == NULL || gram_full(a->grams))) {
+            free(a->grams);
+            a->grams = NULL;
+        }
+        rope_remove_child(n, left + 1);
+    }
+}
+
+/* Returns the leaf holding row at, which must be in range, and sets *start to
+   the index of its first row. Unlike rope_get it leaves the lookup cache
+   alone, and the leaf's next pointers can be followed from any thread while
+   the rope is not being changed. */
+struct rope_node* rope_leaf(struct rope* r, int at, int* start) {
+    struct rope_node* n = r->root;
+    *start = 0;
+    while (!n->leaf) {
+        int k = 0;
+        while (at - *start >= n->child[k]->total) {
+            *start += n->child[k]->total;
+            k++;
+        }
+        n = n->child[k];
+    }
+    return n;
+}
+
+// Returns row at index at, which must be in range
+erow* rope_get(struct rope* r, int at) {
+    struct rope_node* n = r->cache;
+    int start = r->cache_start;
+
+    // Step to a neighbouring leaf when walking rows in order
+    if (n && at >= start + n->count && n->next) {
+        start += n->count;
+        n = n->next;
+    } else if (n && at < start && n->prev) {
+        n = n->prev;
+        start -= n->count;
+    }
+
+    if (n == NULL || at < start || at >= start + n->count) {
+        n = rope_leaf(r, at, &start);
+    }
+
+    r->cache = n;
+    r->cache_start = start;
+    return &n->rows[at - start];
+}
+
+// Opens a slot for a new row at index at and returns it uninitialised
+erow* rope_insert(struct rope* r, int at) {
+    r->cache = NULL;
+    if (r->root == NULL) r->root = rope_node_new(1);
+
+    erow* slot;
+    struct rope_node* split = rope_node_insert(r->root, at, &slot);
+    if (split) {
+        struct rope_node* root = rope_node_new(0);
+        root->child[0] = r->root;
+        root->child[1] = split;
+        root->count = 2;
+        root->total = r->root->total + split->total;
+        r->root = root;
+    }
+    return slot;
+}
+
+// Removes row at index at, the caller frees its contents beforehand
+void rope_delete(struct rope* r, int at) {
+    r->cache = NULL;
+    rope_node_delete(r->root, at);
+
+    while (!r->root->leaf && r->root->count <= 1) {
+        struct rope_node* old = r->root;
+        r->root = old->count ? old->child[0] : NULL;
+        free(old);
+        if (r->root == NULL) return;
+    }
+    if (r->root->total == 0) {
+        rope_node_free(r->root);
+        r->root = NULL;
+    }
+}
+
+void rope_free(struct rope* r) {
+    if (r->root) rope_node_free(r->root);
+    r->root = NULL;
+    r->cache = NULL;
+}
@@ -0,0 +1,686 @@
+#include "./rx.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* PATTERNS */
+
+enum rx_node_type {
+    RX_N_EMPTY,
+    RX_N_CLASS,  // one byte out of class a
+    RX_N_BOL,
+    RX_N_EOL,
+    RX_N_CAT,  // a then b
+    RX_N_ALT,  // a or b
+    RX_N_STAR,
+    RX_N_PLUS,
+    RX_N_QUEST,
+};
+
+struct rx_node {
+    int type;
+    int a, b;
+};
+
+enum rx_op {
+    RX_CLASS,  // takes a byte of class x
+    RX_SPLIT,  // goes on at both x and y
+    RX_JMP,    // goes on at x
+    RX_BOL,
+    RX_EOL,
+    RX_MATCH,
+};
+
+// One NFA instruction, going on to the next one unless it jumps
+struct rx_inst {
+    int op;
+    int x, y;
+};
+
+struct rx_prog {
+    struct rx_inst* inst;
+    int n, cap;
+};
+
+struct rx {
+    unsigned char (*classes)[32];  // bitmaps of the bytes in each class
+    int nclasses;
+    struct rx_prog fwd, rev;  // rev matches the text from the end
+    unsigned char group[256];  // bytes no class tells apart share a group
+    int ngroups;
+};
+
+struct rx_parser {
+    const char* s;
+    int len, pos;
+    int fold;
+    struct rx_node* nodes;
+    int nnodes, cap;
+    struct rx* re;
+    const char* error;
+};
+
+static int rx_node(struct rx_parser* p, int type, int a, int b) {
+    if (p->nnodes == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 32;
+        p->nodes = realloc(p->nodes, sizeof(struct rx_node) * p->cap);
+    }
+    p->nodes[p->nnodes] = (struct rx_node){type, a, b};
+    return p->nnodes++;
+}
+
+static int rx_class_new(struct rx* re) {
+    re->classes = realloc(re->classes, 32 * (re->nclasses + 1));
+    memset(re->classes[re->nclasses], 0, 32);
+    return re->nclasses++;
+}
+
+static void rx_class_add(struct rx* re, int cls, unsigned char c, int fold) {
+    re->classes[cls][c >> 3] |= 1 << (c & 7);
+    if (fold && (c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+        c ^= 0x20;
+        re->classes[cls][c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static void rx_class_range(struct rx* re, int cls, int from, int to,
+                           int fold) {
+    for (int c = from; c <= to; c++) rx_class_add(re, cls, c, fold);
+}
+
+static void rx_class_invert(struct rx* re, int cls) {
+    for (int i = 0; i < 32; i++) re->classes[cls][i] ^= 0xff;
+}
+
+// Adds the bytes of \e to cls, e being one of d w s or their capitals
+static int rx_class_escape(struct rx* re, int cls, char e) {
+    int other = rx_class_new(re);
+    switch (e | 0x20) {
+        case 'd':
+            rx_class_range(re, other, '0', '9', 0);
+            break;
+        case 'w':
+            rx_class_range(re, other, '0', '9', 0);
+            rx_class_range(re, other, 'a', 'z', 1);
+            rx_class_add(re, other, '_', 0);
+            break;
+        case 's':
+            rx_class_add(re, other, ' ', 0);
+            rx_class_range(re, other, '\t', '\r', 0);
+            break;
+        default:
+            re->nclasses--;
+            return 0;
+    }
+    if (!(e & 0x20)) rx_class_invert(re, other);  // capitals negate
+    for (int i = 0; i < 32; i++) re->classes[cls][i] |= re->classes[other][i];
+    re->nclasses--;
+    return 1;
+}
+
+// The byte an escape other than a class stands for
+static char rx_escaped(char e) { return e == 't' ? '\t' : e; }
+
+static int rx_parse_alt(struct rx_parser* p);
+
+// Reads a [ ] class, after the [
+static int rx_parse_class(struct rx_parser* p) {
+    struct rx* re = p->re;
+    int cls = rx_class_new(re);
+    int negate = p->pos < p->len && p->s[p->pos] == '^';
+    if (negate) p->pos++;
+
+    for (int first = 1;; first = 0) {
+        if (p->pos == p->len) {
+            p->error = "missing ]";
+            return cls;
+        }
+        char c = p->s[p->pos++];
+        if (c == ']' && !first) break;
+        if (c == '\\') {
+            if (p->pos == p->len) continue;  // reported as a missing ]
+            c = p->s[p->pos++];
+            if (rx_class_escape(re, cls, c)) continue;
+            c = rx_escaped(c);
+        }
+
+        int to = (unsigned char)c;
+        if (p->pos + 1 < p->len && p->s[p->pos] == '-' &&
+            p->s[p->pos + 1] != ']') {
+            p->pos++;
+            to = (unsigned char)p->s[p->pos++];
+            if (to == '\\' && p->pos < p->len) {
+                to = (unsigned char)rx_escaped(p->s[p->pos++]);
+            }
+            if (to < (unsigned char)c) {
+                p->error = "bad range";
+                return cls;
+            }
+        }
+        rx_class_range(re, cls, (unsigned char)c, to, p->fold);
+    }
+    if (negate) rx_class_invert(re, cls);
+    return cls;
+}
+
+static int rx_parse_atom(struct rx_parser* p) {
+    struct rx* re = p->re;
+    char c = p->s[p->pos++];
+    int cls;
+    switch (c) {
+        case '(': {
+            int inner = rx_parse_alt(p);
+            if (p->pos == p->len) {
+                if (!p->error) p->error = "missing )";
+            } else {
+                p->pos++;
+            }
+            return inner;
+        }
+        case '*':
+        case '+':
+        case '?':
+            p->error = "nothing to repeat";
+            return 0;
+        case '^':
+            return rx_node(p, RX_N_BOL, 0, 0);
+        case '$':
+            return rx_node(p, RX_N_EOL, 0, 0);
+        case '.':
+            cls = rx_class_new(re);
+            rx_class_add(re, cls, '\n', 0);
+            rx_class_invert(re, cls);
+            break;
+        case '[':
+            cls = rx_parse_class(p);
+            break;
+        case '\\':
+            if (p->pos == p->len) {
+                p->error = "trailing \\";
+                return 0;
+            }
+            c = p->s[p->pos++];
+            cls = rx_class_new(re);
+            if (!rx_class_escape(re, cls, c)) {
+                rx_class_add(re, cls, rx_escaped(c), p->fold);
+            }
+            break;
+        default:
+            cls = rx_class_new(re);
+            rx_class_add(re, cls, c, p->fold);
+    }
+    return rx_node(p, RX_N_CLASS, cls, 0);
+}
+
+static int rx_parse_repeat(struct rx_parser* p) {
+    int atom = rx_parse_atom(p);
+    while (!p->error && p->pos < p->len) {
+        char c = p->s[p->pos];
+        int type = (c == '*')   ? RX_N_STAR
+                   : (c == '+') ? RX_N_PLUS
+                   : (c == '?') ? RX_N_QUEST
+                                : -1;
+        if (type < 0) break;
+        p->pos++;
+        atom = rx_node(p, type, atom, 0);
+    }
+    return atom;
+}
+
+static int rx_parse_cat(struct rx_parser* p) {
+    int left = rx_node(p, RX_N_EMPTY, 0, 0);
+    while (!p->error && p->pos < p->len && p->s[p->pos] != '|' &&
+           p->s[p->pos] != ')') {
+        int right = rx_parse_repeat(p);
+        left = rx_node(p, RX_N_CAT, left, right);
+    }
+    return left;
+}
+
+static int rx_parse_alt(struct rx_parser* p) {
+    int left = rx_parse_cat(p);
+    while (!p->error && p->pos < p->len && p->s[p->pos] == '|') {
+        p->pos++;
+        int right = rx_parse_cat(p);
+        left = rx_node(p, RX_N_ALT, left, right);
+    }
+    return left;
+}
+
+/* COMPILING */
+
+static int rx_inst_add(struct rx_prog* g, int op, int x, int y) {
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 32;
+        g->inst = realloc(g->inst, sizeof(struct rx_inst) * g->cap);
+    }
+    g->inst[g->n] = (struct rx_inst){op, x, y};
+    return g->n++;
+}
+
+// Emits node i, with everything read backwards if rev is set
+static void rx_emit(struct rx_prog* g, const struct rx_node* nodes, int i,
+                    int rev) {
+    const struct rx_node* n = &nodes[i];
+    int at, jmp;
+    switch (n->type) {
+        case RX_N_EMPTY:
+            break;
+        case RX_N_CLASS:
+            rx_inst_add(g, RX_CLASS, n->a, 0);
+            break;
+        case RX_N_BOL:
+            rx_inst_add(g, rev ? RX_EOL : RX_BOL, 0, 0);
+            break;
+        case RX_N_EOL:
+            rx_inst_add(g, rev ? RX_BOL : RX_EOL, 0, 0);
+            break;
+        case RX_N_CAT:
+            rx_emit(g, nodes, rev ? n->b : n->a, rev);
+            rx_emit(g, nodes, rev ? n->a : n->b, rev);
+            break;
+        case RX_N_ALT:
+            at = rx_inst_add(g, RX_SPLIT, g->n + 1, 0);
+            rx_emit(g, nodes, n->a, rev);
+            jmp = rx_inst_add(g, RX_JMP, 0, 0);
+            g->inst[at].y = g->n;
+            rx_emit(g, nodes, n->b, rev);
+            g->inst[jmp].x = g->n;
+            break;
+        case RX_N_STAR:
+            at = rx_inst_add(g, RX_SPLIT, g->n + 1, 0);
+            rx_emit(g, nodes, n->a, rev);
+            rx_inst_add(g, RX_JMP, at, 0);
+            g->inst[at].y = g->n;
+            break;
+        case RX_N_PLUS:
+            at = g->n;
+            rx_emit(g, nodes, n->a, rev);
+            rx_inst_add(g, RX_SPLIT, at, g->n + 1);
+            break;
+        case RX_N_QUEST:
+            at = rx_inst_add(g, RX_SPLIT, g->n + 1, 0);
+            rx_emit(g, nodes, n->a, rev);
+            g->inst[at].y = g->n;
+            break;
+    }
+}
+
+static int rx_has(const struct rx* re, int cls, unsigned char c) {
+    return re->classes[cls][c >> 3] >> (c & 7) & 1;
+}
+
+// Puts neighbouring bytes that every class treats alike in one group
+static void rx_group(struct rx* re) {
+    re->group[0] = 0;
+    re->ngroups = 1;
+    for (int c = 1; c < 256; c++) {
+        int same = 1;
+        for (int k = 0; k < re->nclasses && same; k++) {
+            same = rx_has(re, k, c) == rx_has(re, k, c - 1);
+        }
+        if (!same) re->ngroups++;
+        re->group[c] = re->ngroups - 1;
+    }
+}
+
+struct rx* rx_compile(const char* pattern, int len, int fold,
+                      const char** error) {
+    struct rx* re = calloc(1, sizeof(struct rx));
+    struct rx_parser p = {pattern, len, 0, fold, NULL, 0, 0, re, NULL};
+    int root = rx_parse_alt(&p);
+    if (!p.error && p.pos < len) p.error = "unmatched )";
+    if (p.error) {
+        *error = p.error;
+        free(p.nodes);
+        rx_free(re);
+        return NULL;
+    }
+
+    rx_emit(&re->fwd, p.nodes, root, 0);
+    rx_inst_add(&re->fwd, RX_MATCH, 0, 0);
+    rx_emit(&re->rev, p.nodes, root, 1);
+    rx_inst_add(&re->rev, RX_MATCH, 0, 0);
+    rx_group(re);
+    free(p.nodes);
+    return re;
+}
+
+void rx_free(struct rx* re) {
+    if (re == NULL) return;
+    free(re->classes);
+    free(re->fwd.inst);
+    free(re->rev.inst);
+    free(re);
+}
+
+/* DFA */
+
+/* A DFA state is the set of NFA instructions that can go on from a point in
+   the text, keeping only the ones that take a byte, match, or wait for the
+   end of the text. */
+struct rx_state {
+    int set, nset;   // at sets[set], in order
+    int accept;      // a match ends here
+    int accept_end;  // a match ends here if the text does
+};
+
+struct rx_cache {
+    const struct rx* re;
+    const struct rx_prog* prog;
+    int floating;  // matches may start after any byte, not only the first
+    struct rx_state* states;
+    int nstates;
+    int* next;  // by state and byte group, -1 until stepped through
+    int* sets;
+    int nsets, setcap;
+    int* table;  // states by hash of their set, -1 where empty
+    int start[2];  // away from and at the start of the text, -1 until built
+    int cleared;   // times the states were dropped
+
+    // Scratch space while building states
+    int* stack;
+    int* list;
+    unsigned* mark;
+    unsigned gen;
+    int* floatset;  // the start away from the text start, when floating
+    int nfloat;
+    unsigned char wake[256];  // bytes that lead out of the empty set then
+};
+
+struct rx_dfa {
+    struct rx_cache fwd, rev;
+    int* starts;  // where matches start in the text, last first
+    int nstarts, cap;
+    unsigned long long* dead;  // by byte, forward states known to match no more
+    int deadcap;
+};
+
+#define RX_TABLE (RX_DFA_STATES * 2)
+
+static void rx_cache_clear(struct rx_cache* c) {
+    c->nstates = 0;
+    c->nsets = 0;
+    c->start[0] = c->start[1] = -1;
+    c->cleared++;
+    for (int i = 0; i < RX_TABLE; i++) c->table[i] = -1;
+}
+
+static void rx_next_gen(struct rx_cache* c) {
+    if (++c->gen == 0) {
+        memset(c->mark, 0, sizeof(unsigned) * c->prog->n);
+        c->gen = 1;
+    }
+}
+
+/* Adds what pc leads to without taking a byte to list. ^ is passed only if
+   bol is set and $ only if eol is, otherwise a $ is kept in the list. */
+static void rx_add(struct rx_cache* c, int* n, int pc, int bol, int eol) {
+    const struct rx_inst* inst = c->prog->inst;
+    int top = 0;
+    c->stack[top++] = pc;
+    while (top) {
+        pc = c->stack[--top];
+        if (c->mark[pc] == c->gen) continue;
+        c->mark[pc] = c->gen;
+        switch (inst[pc].op) {
+            case RX_SPLIT:
+                c->stack[top++] = inst[pc].y;
+                c->stack[top++] = inst[pc].x;
+                break;
+            case RX_JMP:
+                c->stack[top++] = inst[pc].x;
+                break;
+            case RX_BOL:
+                if (bol) c->stack[top++] = pc + 1;
+                break;
+            case RX_EOL:
+                if (eol) {
+                    c->stack[top++] = pc + 1;
+                    break;
+                }
+                c->list[(*n)++] = pc;
+                break;
+            default:
+                c->list[(*n)++] = pc;
+        }
+    }
+}
+
+static int rx_cmp(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Returns the state for the n instructions in c->list, building it if new
+static int rx_state(struct rx_cache* c, int n) {
+    qsort(c->list, n, sizeof(int), rx_cmp);
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ c->list[i]) * 16777619u;
+
+    int slot = h % RX_TABLE;
+    for (; c->table[slot] >= 0; slot = (slot + 1) % RX_TABLE) {
+        struct rx_state* s = &c->states[c->table[slot]];
+        if (s->nset == n &&
+            !memcmp(&c->sets[s->set], c->list, sizeof(int) * n)) {
+            return c->table[slot];
+        }
+    }
+
+    if (c->nstates == RX_DFA_STATES) {
+        rx_cache_clear(c);
+        return rx_state(c, n);
+    }
+    if (c->nsets + n > c->setcap) {
+        while (c->nsets + n > c->setcap) c->setcap *= 2;
+        c->sets = realloc(c->sets, sizeof(int) * c->setcap);
+    }
+    memcpy(&c->sets[c->nsets], c->list, sizeof(int) * n);
+
+    int id = c->nstates++;
+    struct rx_state* s = &c->states[id];
+    *s = (struct rx_state){c->nsets, n, 0, 0};
+    c->nsets += n;
+    c->table[slot] = id;
+    for (int g = 0; g < c->re->ngroups; g++) {
+        c->next[id * c->re->ngroups + g] = -1;
+    }
+
+    // The list is reused from here, the set is safe in c->sets
+    const struct rx_inst* inst = c->prog->inst;
+    const int* set = &c->sets[s->set];
+    rx_next_gen(c);
+    int ends = 0;
+    for (int i = 0; i < n; i++) {
+        if (inst[set[i]].op == RX_MATCH) s->accept = 1;
+        if (inst[set[i]].op == RX_EOL) rx_add(c, &ends, set[i] + 1, 0, 1);
+    }
+    s->accept_end = s->accept;
+    for (int i = 0; i < ends; i++) {
+        if (inst[c->list[i]].op == RX_MATCH) s->accept_end = 1;
+    }
+    return id;
+}
+
+static int rx_start(struct rx_cache* c, int bol) {
+    if (c->start[bol] < 0) {
+        rx_next_gen(c);
+        int n = 0;
+        rx_add(c, &n, 0, bol, 0);
+        c->start[bol] = rx_state(c, n);
+    }
+    return c->start[bol];
+}
+
+// Builds the state after byte, for rx_next to find from then on
+static int rx_step(struct rx_cache* c, int state, unsigned char byte) {
+    const struct rx* re = c->re;
+    int* next = &c->next[state * re->ngroups + re->group[byte]];
+
+    const struct rx_inst* inst = c->prog->inst;
+    struct rx_state* s = &c->states[state];
+    rx_next_gen(c);
+    int n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const int* set = pass ? c->floatset : &c->sets[s->set];
+        int nset = pass ? (c->floating ? c->nfloat : 0) : s->nset;
+        for (int i = 0; i < nset; i++) {
+            const struct rx_inst* in = &inst[set[i]];
+            if (in->op == RX_CLASS && rx_has(re, in->x, byte)) {
+                rx_add(c, &n, set[i] + 1, 0, 0);
+            }
+        }
+    }
+
+    int cleared = c->cleared;
+    int to = rx_state(c, n);
+    if (c->cleared == cleared) *next = to;
+    return to;
+}
+
+static inline int rx_next(struct rx_cache* c, int state, unsigned char byte) {
+    int next = c->next[state * c->re->ngroups + c->re->group[byte]];
+    return next >= 0 ? next : rx_step(c, state, byte);
+}
+
+static void rx_cache_init(struct rx_cache* c, const struct rx* re,
+                          const struct rx_prog* prog, int floating) {
+    int n = prog->n;
+    c->re = re;
+    c->prog = prog;
+    c->floating = floating;
+    c->states = malloc(sizeof(struct rx_state) * RX_DFA_STATES);
+    c->next = malloc(sizeof(int) * RX_DFA_STATES * re->ngroups);
+    c->setcap = 256;
+    c->sets = malloc(sizeof(int) * c->setcap);
+    c->table = malloc(sizeof(int) * RX_TABLE);
+    c->stack = malloc(sizeof(int) * (2 * n + 1));
+    c->list = malloc(sizeof(int) * n);
+    c->mark = calloc(n, sizeof(unsigned));
+    c->gen = 0;
+    c->cleared = 0;
+    rx_cache_clear(c);
+
+    c->nfloat = 0;
+    c->floatset = NULL;
+    if (floating) {
+        rx_next_gen(c);
+        rx_add(c, &c->nfloat, 0, 0, 0);
+        c->floatset = malloc(sizeof(int) * (c->nfloat + 1));
+        memcpy(c->floatset, c->list, sizeof(int) * c->nfloat);
+    }
+    for (int b = 0; b < 256; b++) {
+        c->wake[b] = 0;
+        for (int i = 0; i < c->nfloat; i++) {
+            const struct rx_inst* in = &prog->inst[c->floatset[i]];
+            if (in->op == RX_CLASS && rx_has(re, in->x, b)) c->wake[b] = 1;
+        }
+    }
+}
+
+static void rx_cache_free(struct rx_cache* c) {
+    free(c->states);
+    free(c->next);
+    free(c->sets);
+    free(c->table);
+    free(c->stack);
+    free(c->list);
+    free(c->mark);
+    free(c->floatset);
+}
+
+struct rx_dfa* rx_dfa_new(const struct rx* re) {
+    struct rx_dfa* d = malloc(sizeof(struct rx_dfa));
+    rx_cache_init(&d->fwd, re, &re->fwd, 0);
+    rx_cache_init(&d->rev, re, &re->rev, 1);
+    d->starts = NULL;
+    d->nstarts = d->cap = 0;
+    d->dead = NULL;
+    d->deadcap = 0;
+    return d;
+}
+
+void rx_dfa_free(struct rx_dfa* d) {
+    if (d == NULL) return;
+    rx_cache_free(&d->fwd);
+    rx_cache_free(&d->rev);
+    free(d->starts);
+    free(d->dead);
+    free(d);
+}
+
+/* MATCHING */
+
+void rx_find_all(struct rx_dfa* d, const char* s, int len,
+                 void (*found)(void*, int, int), void* arg) {
+    // Read backwards, the state after byte i tells if a match starts there.
+    // While no match is under way, bytes none can end with are skipped.
+    struct rx_cache* rev = &d->rev;
+    int state = rx_start(rev, 1);
+    d->nstarts = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        if (rev->states[state].nset == 0) {
+            while (i >= 0 && !rev->wake[(unsigned char)s[i]]) i--;
+            if (i < 0) break;
+        }
+        state = rx_next(rev, state, s[i]);
+        struct rx_state* st = &rev->states[state];
+        if (st->accept || (i == 0 && st->accept_end)) {
+            if (d->nstarts == d->cap) {
+                d->cap = d->cap ? d->cap * 2 : 64;
+                d->starts = realloc(d->starts, sizeof(int) * d->cap);
+            }
+            d->starts[d->nstarts++] = i;
+        }
+    }
+
+    // From the leftmost start the longest match is taken, and the next one
+    // is looked for after it. The DFA has to read on until no match can be
+    // longer, so the states it was in past the end of the match are kept,
+    // and a later start reaching one of them at the same byte stops there.
+    // That way no state is read on from twice at a byte, so the text is read
+    // a bounded number of times over while the first 64 states are not
+    // dropped.
+    struct rx_cache* fwd = &d->fwd;
+    int cleared = fwd->cleared, kept = 0;
+    for (int k = d->nstarts - 1, from = 0; k >= 0; k--) {
+        int i = d->starts[k];
+        if (i < from) continue;
+
+        int end = i, at = -1, j = i;
+        int memo = kept && fwd->cleared == cleared;
+        state = rx_start(fwd, i == 0);
+        while (j < len) {
+            state = rx_next(fwd, state, s[j++]);
+            struct rx_state* st = &fwd->states[state];
+            if (st->nset == 0) break;
+            if (st->accept || (j == len && st->accept_end)) {
+                end = j;
+                at = state;
+            } else if (memo && state < 64 && d->dead[j] >> state & 1) {
+                break;
+            }
+        }
+
+        // Reads the bytes after the match again, or from the start if there
+        // is none, to keep the states
+        if (j - end > 1 && fwd->cleared == cleared) {
+            if (!kept) {
+                if (len + 1 > d->deadcap) {
+                    free(d->dead);
+                    d->deadcap = len + 1;
+                    d->dead = malloc(sizeof(unsigned long long) * d->deadcap);
+                }
+                memset(d->dead, 0, sizeof(unsigned long long) * (len + 1));
+                kept = 1;
+            }
+            state = at >= 0 ? at : rx_start(fwd, i == 0);
+            for (int p = end; p < j;) {
+                state = rx_next(fwd, state, s[p++]);
+                if (state < 64) d->dead[p] |= 1ull << state;
+            }
+        }
+
+        if (end > i) found(arg, i, end - i);
+        from = end;
+    }
+}
@@ -0,0 +1,301 @@
+#include "./scan.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i vec;
+#define VEC_BYTES 32
+#define VEC_ALL 0xffffffffu
+#define vec_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_sub(a, b) _mm256_sub_epi8(a, b)
+#define vec_mask(v) ((unsigned int)_mm256_movemask_epi8(v))
+static int vec_sum(vec v) {  // of the bytes
+    v = _mm256_sad_epu8(v, _mm256_setzero_si256());
+    return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+           _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i vec;
+#define VEC_BYTES 16
+#define VEC_ALL 0xffffu
+#define vec_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_sub(a, b) _mm_sub_epi8(a, b)
+#define vec_mask(v) ((unsigned int)_mm_movemask_epi8(v))
+static int vec_sum(vec v) {  // of the bytes
+    v = _mm_sad_epu8(v, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(v) + _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+#endif
+
+static int is_word(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+int scan_word(const char* s, int len) {
+    int i = 0;
+#ifdef VEC_BYTES
+    // Compares are signed, so bytes above 0x7f fall outside every range
+    vec below_a = vec_set1('a' - 1), above_z = vec_set1('z' + 1);
+    vec below_0 = vec_set1('0' - 1), above_9 = vec_set1('9' + 1);
+    vec lower = vec_set1(0x20), under = vec_set1('_');
+    for (; i + VEC_BYTES <= len; i += VEC_BYTES) {
+        vec v = vec_load(s + i);
+        vec l = vec_or(v, lower);  // folds A-Z onto a-z
+        vec word = vec_or(vec_and(vec_gt(l, below_a), vec_gt(above_z, l)),
+                          vec_and(vec_gt(v, below_0), vec_gt(above_9, v)));
+        word = vec_or(word, vec_eq(v, under));
+
+        unsigned int other = ~vec_mask(word) & VEC_ALL;
+        if (other) return i + __builtin_ctz(other);
+    }
+#endif
+    while (i < len && is_word(s[i])) i++;
+    return i;
+}
+
+int scan_blank(const char* s, int len) {
+    int i = 0;
+#ifdef VEC_BYTES
+    vec space = vec_set1(' ');
+    for (; i + VEC_BYTES <= len; i += VEC_BYTES) {
+        unsigned int other =
+            ~vec_mask(vec_eq(vec_load(s + i), space)) & VEC_ALL;
+        if (other) return i + __builtin_ctz(other);
+    }
+#endif
+    while (i < len && s[i] == ' ') i++;
+    return i;
+}
+
+int scan_until2(const char* s, int len, char a, char b) {
+    int i = 0;
+#ifdef VEC_BYTES
+    vec va = vec_set1(a), vb = vec_set1(b);
+    for (; i + VEC_BYTES <= len; i += VEC_BYTES) {
+        vec v = vec_load(s + i);
+        unsigned int hit = vec_mask(vec_or(vec_eq(v, va), vec_eq(v, vb)));
+        if (hit) return i + __builtin_ctz(hit);
+    }
+#endif
+    while (i < len && s[i] != a && s[i] != b) i++;
+    return i;
+}
+
+int scan_count(const char* s, int len, char c) {
+    int i = 0, count = 0;
+#ifdef VEC_BYTES
+    // Matches are -1, taken from a count per byte that is added up before
+    // it can wrap
+    vec vc = vec_set1(c);
+    while (i + VEC_BYTES <= len) {
+        vec counts = vec_set1(0);
+        for (int k = 0; k < 255 && i + VEC_BYTES <= len; k++, i += VEC_BYTES) {
+            counts = vec_sub(counts, vec_eq(vec_load(s + i), vc));
+        }
+        count += vec_sum(counts);
+    }
+#endif
+    for (; i < len; i++) count += s[i] == c;
+    return count;
+}
+
+// Without vectors, needles longer than this are found with Horspool's skips.
+// Either way they go over to Two-Way once the places tried have cost more
+// than SCAN_SPEND bytes compared for each byte passed.
+#define SCAN_SKIP_NEEDLE 32
+#define SCAN_SPEND 4
+
+// Lower cases ASCII letters, the only ones scan_find folds
+static unsigned char fold_byte(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static int same(const char* a, const char* b, int n, int fold) {
+    if (!fold) return memcmp(a, b, n) == 0;
+    for (int i = 0; i < n; i++) {
+        if (fold_byte(a[i]) != fold_byte(b[i])) return 0;
+    }
+    return 1;
+}
+
+// Byte of a needle or text as it is compared
+static unsigned char key(unsigned char c, int fold) {
+    return fold ? fold_byte(c) : c;
+}
+
+/* Start of the maximal suffix of the needle, by the order of bytes or its
+   reverse if less is set, and its period in *per (Crochemore and Perrin). */
+static int max_suffix(const unsigned char* n, int nlen, int fold, int less,
+                      int* per) {
+    int ms = -1, j = 0, k = 1;
+    *per = 1;
+    while (j + k < nlen) {
+        unsigned char a = key(n[j + k], fold), b = key(n[ms + k], fold);
+        if (a == b) {
+            if (k == *per) {
+                j += *per;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if ((a < b) != less) {
+            j += k;
+            k = 1;
+            *per = j - ms;
+        } else {
+            ms = j++;
+            k = *per = 1;
+        }
+    }
+    return ms;
+}
+
+/* Two-Way: the needle is split where its two halves can be matched from the
+   split outwards and moved on without ever looking at a text byte twice too
+   often, so finding it takes time linear in len whatever the bytes are. */
+static int find_two_way(const char* str, int len, const char* ndl, int nlen,
+                        int fold) {
+    const unsigned char* s = (const unsigned char*)str;
+    const unsigned char* n = (const unsigned char*)ndl;
+    int p1, p2;
+    int ms1 = max_suffix(n, nlen, fold, 0, &p1);
+    int ms2 = max_suffix(n, nlen, fold, 1, &p2);
+    int ell = ms1 > ms2 ? ms1 : ms2;
+    int per = ms1 > ms2 ? p1 : p2;
+
+    if (same(ndl, ndl + per, ell + 1, fold)) {
+        // Periodic needle: after a shift by the period the part of the left
+        // half still in place is already known to match
+        int memory = -1;
+        for (int j = 0; j + nlen <= len;) {
+            int i = (ell > memory ? ell : memory) + 1;
+            while (i < nlen && key(n[i], fold) == key(s[i + j], fold)) i++;
+            if (i < nlen) {
+                j += i - ell;
+                memory = -1;
+                continue;
+            }
+            i = ell;
+            while (i > memory && key(n[i], fold) == key(s[i + j], fold)) i--;
+            if (i <= memory) return j;
+            j += per;
+            memory = nlen - per - 1;
+        }
+        return len;
+    }
+
+    per = (ell + 1 > nlen - ell - 1 ? ell + 1 : nlen - ell - 1) + 1;
+    for (int j = 0; j + nlen <= len;) {
+        int i = ell + 1;
+        while (i < nlen && key(n[i], fold) == key(s[i + j], fold)) i++;
+        if (i < nlen) {
+            j += i - ell;
+            continue;
+        }
+        i = ell;
+        while (i >= 0 && key(n[i], fold) == key(s[i + j], fold)) i--;
+        if (i < 0) return j;
+        j += per;
+    }
+    return len;
+}
+
+// Charges place k, which did not match, the whole needle. Returns 1 once
+// that has cost a long needle too much, and the search goes over to Two-Way.
+static int over_budget(long* spent, int k, int nlen) {
+    *spent += nlen;
+    return nlen > SCAN_SKIP_NEEDLE && *spent > SCAN_SPEND * ((long)k + nlen);
+}
+
+#ifndef VEC_BYTES
+// Boyer-Moore-Horspool, moving on by how far back the last byte looked at
+// appears in the needle
+static int find_skip(const char* s, int len, const char* n, int nlen,
+                     int fold) {
+    int skip[256];
+    for (int c = 0; c < 256; c++) skip[c] = nlen;
+    for (int i = 0; i < nlen - 1; i++) {
+        unsigned char c = n[i];
+        skip[c] = nlen - 1 - i;
+        if (fold && (c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+            skip[c | 0x20] = skip[c & ~0x20] = nlen - 1 - i;
+        }
+    }
+    long spent = 0;
+    for (int i = 0; i + nlen <= len;
+         i += skip[(unsigned char)s[i + nlen - 1]]) {
+        if (same(s + i, n, nlen, fold)) return i;
+        if (over_budget(&spent, i, nlen)) {
+            return i + 1 + find_two_way(s + i + 1, len - i - 1, n, nlen, fold);
+        }
+    }
+    return len;
+}
+#endif
+
+int scan_find(const char* s, int len, const char* n, int nlen, int fold) {
+    if (nlen == 0) return 0;
+    if (nlen > len) return len;
+#ifndef VEC_BYTES
+    if (nlen > SCAN_SKIP_NEEDLE) return find_skip(s, len, n, nlen, fold);
+#endif
+
+    unsigned char first = n[0], last = n[nlen - 1];
+    if (fold) {
+        first = fold_byte(first);
+        last = fold_byte(last);
+    }
+    int i = 0;
+    long spent = 0;  // see over_budget
+#ifdef VEC_BYTES
+    // Only places where both the first and the last byte match are compared
+    vec vf = vec_set1(first), vl = vec_set1(last);
+    vec below_A = vec_set1('A' - 1), above_Z = vec_set1('Z' + 1);
+    vec lower = vec_set1(0x20);
+    for (; i + nlen - 1 + VEC_BYTES <= len; i += VEC_BYTES) {
+        vec a = vec_load(s + i), b = vec_load(s + i + nlen - 1);
+        if (fold) {
+            a = vec_or(a, vec_and(vec_and(vec_gt(a, below_A),
+                                          vec_gt(above_Z, a)), lower));
+            b = vec_or(b, vec_and(vec_and(vec_gt(b, below_A),
+                                          vec_gt(above_Z, b)), lower));
+        }
+        unsigned int hit = vec_mask(vec_and(vec_eq(a, vf), vec_eq(b, vl)));
+        for (; hit; hit &= hit - 1) {
+            int k = i + __builtin_ctz(hit);
+            if (same(s + k, n, nlen, fold)) return k;
+            if (over_budget(&spent, k, nlen)) {
+                return k + 1 +
+                       find_two_way(s + k + 1, len - k - 1, n, nlen, fold);
+            }
+        }
+    }
+#endif
+    for (; i + nlen <= len; i++) {
+        if (!fold) {
+            const char* p = memchr(s + i, first, len - nlen + 1 - i);
+            if (p == NULL) break;
+            i = p - s;
+        } else if (fold_byte(s[i]) != first) {
+            continue;
+        }
+        if (same(s + i, n, nlen, fold)) return i;
+        if (over_budget(&spent, i, nlen)) {
+            return i + 1 + find_two_way(s + i + 1, len - i - 1, n, nlen, fold);
+        }
+    }
+    return len;
+}
@@ -0,0 +1,207 @@
+#include "./undo.h"
+
+#include <string.h>
+
+struct undo_block {
+    struct undo_block* next;
+    size_t cap, used;  // bytes of data
+    char data[];
+};
+
+// Bytes a record holding len bytes of text takes, keeping the next aligned
+static size_t undo_rec_size(int len) {
+    return (sizeof(struct undo_rec) + len + 7) & ~(size_t)7;
+}
+
+static void undo_release(struct undo_log* u, struct undo_block* b) {
+    size_t cap = sizeof(struct undo_block) + b->cap;
+    u->size -= cap;
+    arena_release(&u->mem, b, cap);
+}
+
+// Room for a record of len bytes of text at the end of the log
+static struct undo_rec* undo_alloc(struct undo_log* u, int len) {
+    size_t need = undo_rec_size(len);
+    struct undo_block* b = u->last;
+    if (b == NULL || b->cap - b->used < need) {
+        size_t want = sizeof(struct undo_block) + need;
+        size_t cap;
+        b = arena_alloc(&u->mem, want > UNDO_BLOCK ? want : UNDO_BLOCK, &cap);
+        b->next = NULL;
+        b->cap = cap - sizeof(struct undo_block);
+        b->used = 0;
+        if (u->last) {
+            u->last->next = b;
+        } else {
+            u->first = b;
+        }
+        u->last = b;
+        u->size += cap;
+    }
+    struct undo_rec* r = (struct undo_rec*)&b->data[b->used];
+    b->used += need;
+    return r;
+}
+
+// Cuts the log off after u->done, dropping every record that was undone
+static void undo_drop_undone(struct undo_log* u) {
+    struct undo_rec* from = u->done ? u->done->next : u->oldest;
+    if (from == NULL) return;
+
+    struct undo_block* b = u->first;
+    while ((char*)from < b->data || (char*)from >= b->data + b->used) {
+        b = b->next;
+    }
+    while (b->next) {
+        struct undo_block* next = b->next->next;
+        undo_release(u, b->next);
+        b->next = next;
+    }
+    b->used = (char*)from - b->data;
+    u->last = b;
+
+    u->newest = u->done;
+    if (u->done) {
+        u->done->next = NULL;
+    } else {
+        u->oldest = NULL;
+    }
+}
+
+/* Releases the oldest blocks while the log is over budget, the newest one
+   always stays. Records left behind by a step that lost its start can no
+   longer be undone, so the log then starts at the next step. */
+static void undo_trim(struct undo_log* u) {
+    if (u->size <= u->budget || u->first == u->last) return;
+    while (u->size > u->budget && u->first != u->last) {
+        struct undo_block* b = u->first;
+        struct undo_rec* r = u->oldest;
+        while (r && (char*)r >= b->data && (char*)r < b->data + b->used) {
+            r = r->next;
+        }
+        u->oldest = r;
+        u->first = b->next;
+        undo_release(u, b);
+    }
+
+    struct undo_rec* r = u->oldest;
+    while (r && !r->step) r = r->next;
+    if (r) {
+        r->prev = NULL;
+        u->oldest = r;
+        return;
+    }
+
+    // Only the step being recorded is left, and it is no longer whole
+    while (u->first) {
+        struct undo_block* b = u->first;
+        u->first = b->next;
+        undo_release(u, b);
+    }
+    u->last = NULL;
+    u->oldest = u->newest = u->done = u->keys = NULL;
+    u->lost = 1;
+}
+
+// Makes the next record start a step of its own
+void undo_step(struct undo_log* u) {
+    u->step = 1;
+    u->lost = 0;
+}
+
+/* Records an edit as part of the current step, after dropping whatever was
+   undone. The row and cx of each record are where it applies once every one
+   before it has been. */
+void undo_add(struct undo_log* u, int kind, int row, int cx, const char* text,
+              int len) {
+    u->keys = NULL;
+    if (u->lost) return;
+    if (u->done != u->newest) undo_drop_undone(u);
+
+    struct undo_rec* r = undo_alloc(u, len);
+    r->prev = u->newest;
+    r->next = NULL;
+    r->kind = kind;
+    r->row = row;
+    r->cx = cx;
+    r->len = len;
+    r->step = u->step || u->newest == NULL;
+    if (len) memcpy(r->text, text, len);
+
+    if (u->newest) {
+        u->newest->next = r;
+    } else {
+        u->oldest = r;
+    }
+    u->newest = u->done = r;
+    u->step = 0;
+    undo_trim(u);
+}
+
+// Lets the keys that follow be added to the newest record, see undo_join
+void undo_keys(struct undo_log* u) {
+    u->keys = u->newest;
+}
+
+/* Adds text typed or deleted at cx of row to the newest record, if undo_keys
+   was called for it and it holds the same kind of edit right next to it, so a
+   run of keys is undone at once. Returns 0 if it could not, recording
+   nothing. */
+int undo_join(struct undo_log* u, int kind, int row, int cx, const char* text,
+              int len) {
+    struct undo_rec* r = u->newest;
+    if (r == NULL || r != u->keys || u->done != r || r->kind != kind ||
+        r->row != row) {
+        return 0;
+    }
+
+    int at;  // where the text goes among r's
+    if (kind == UNDO_INSERT && cx == r->cx + r->len) {
+        at = r->len;
+    } else if (kind == UNDO_DELETE && cx + len == r->cx) {  // backspace
+        at = 0;
+    } else if (kind == UNDO_DELETE && cx == r->cx) {  // delete
+        at = r->len;
+    } else {
+        return 0;
+    }
+
+    // The newest record ends the last block, so it grows in place
+    struct undo_block* b = u->last;
+    size_t grow = undo_rec_size(r->len + len) - undo_rec_size(r->len);
+    if (b->cap - b->used < grow) return 0;
+    b->used += grow;
+
+    memmove(&r->text[at + len], &r->text[at], r->len - at);
+    memcpy(&r->text[at], text, len);
+    r->len += len;
+    if (at == 0) r->cx = cx;
+    return 1;
+}
+
+/* Steps back over the newest record not undone and returns it, or NULL if
+   there is none. A whole step is undone by calling this until a record that
+   starts one comes back. */
+struct undo_rec* undo_back(struct undo_log* u) {
+    struct undo_rec* r = u->done;
+    if (r) u->done = r->prev;
+    return r;
+}
+
+/* Steps forward over the next record undone and returns it, or NULL if there
+   is none. With within set a record starting a step is not stepped over, so
+   a step is redone by calling this once without and then with it. */
+struct undo_rec* undo_forward(struct undo_log* u, int within) {
+    struct undo_rec* r = u->done ? u->done->next : u->oldest;
+    if (r == NULL || (within && r->step)) return NULL;
+    u->done = r;
+    return r;
+}
+
+void undo_free(struct undo_log* u) {
+    arena_free(&u->mem);
+    u->first = u->last = NULL;
+    u->oldest = u->newest = u->done = u->keys = NULL;
+    u->size = 0;
+    u->step = u->lost = 0;
+}